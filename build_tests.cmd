@@ -1,7 +1,9 @@
 @echo off
+echo Build test_cu32.exe
+gcc -o test_cu32 src\cu32.c src\test_cu32.c -g
 echo Build test_lexicon.exe
 gcc -o test_lexicon src\cu32.c src\lexicon.c src\test_lexicon.c -g
 echo Build test_minseg.exe
 gcc -o test_minseg src\cu32.c src\lexicon.c src\minseg.c src\test_minseg.c -g
 echo Build test_lexhnd.exe
-gcc -o test_lexhnd src\cu32.c src\lexicon.c src\minseg.c src\lexhnd.c src\test_lexhnd.c -g
+gcc -o test_lexhnd src\cu32.c src\lexicon.c src\minseg.c src\lexhnd.c src\test_lexhnd.c -g -lpthread
@@ -7,7 +7,10 @@
 /* CU32
  * Rotinas para conversão de strings em utf8 para
  * strings de caracteres de largura fixa de 32bits.
- * Não há conversão garantida para utf32 no momento.
+ * As rotinas u8to32/u32to8 usam o modo legado, que guarda
+ * os bytes UTF8 de cada caractere empacotados em 32bits.
+ * u8to32_utf/u32to8_utf convertem para pontos de código
+ * Unicode (UTF32) com validação.
  * Use para facilitar acesso randômico a caracteres 
  * unicode internamente ao programa.
  * 
@@ -20,10 +23,9 @@
 #include <string.h>
 #include <malloc.h>
 #include <stdio.h>
-
-#define FIRST_OF_TWO_BYTES_SEQ 0xC0
-#define FIRST_OF_THREE_BYTES_SEQ 0xE0
-#define FIRST_OF_FOUR_BYTES_SEQ 0xF0
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define FOUR_BYTES 0x1000000
 #define THREE_BYTES 0x10000
@@ -34,11 +36,9 @@ size_t u8strlen(const char* u8str)
     size_t len = 0;
     while(*u8str)
     {
-        unsigned char chr = (unsigned char) *u8str;
-        if(chr > FIRST_OF_FOUR_BYTES_SEQ) u8str = u8str + 4;
-        else if(chr > FIRST_OF_THREE_BYTES_SEQ) u8str = u8str + 3;
-        else if(chr > FIRST_OF_TWO_BYTES_SEQ) u8str = u8str + 2;
-        else u8str++;
+        // um byte inválido conta como um caractere
+        size_t sz = u8seqlen((unsigned char) *u8str);
+        u8str = u8str + (sz ? sz : 1);
         len++;
     }
     return len;
@@ -54,11 +54,7 @@ size_t u32strlen(const char32_t* u32str)
 
 void u32strcpy(char32_t* dest, const char32_t* src)
 {
-    for(size_t i=0;i<u32strlen(src);i++)
-    {
-        dest[i] = src[i];
-    }
-    dest[u32strlen(src)] = '\0';
+    while((*dest++ = *src++));
 }
 
 void u32strncpy(char32_t* dest, const char32_t* src, size_t n)
@@ -72,13 +68,12 @@ void u32strncpy(char32_t* dest, const char32_t* src, size_t n)
 
 int8_t u32streq(const char32_t* str_a, const char32_t* str_b)
 {
-    size_t len_a = u32strlen(str_a);
-    if(len_a != u32strlen(str_b)) return 0;
-    for(size_t i=0;i<len_a;i++)
+    while(*str_a && *str_a == *str_b)
     {
-        if(str_a[i] != str_b[i]) return 0;
+        str_a++;
+        str_b++;
     }
-    return 1;
+    return *str_a == *str_b;
 }
 
 size_t u8to32(const char* u8str, char32_t* u32str)
@@ -88,12 +83,8 @@ size_t u8to32(const char* u8str, char32_t* u32str)
 
     for(size_t i=0;i<runelen;i++)
     {
-        unsigned char chr = (unsigned char) *u8str;
-        unsigned char sz = 0;
-        if(chr > FIRST_OF_FOUR_BYTES_SEQ) sz = 4;
-        else if (chr > FIRST_OF_THREE_BYTES_SEQ) sz = 3;
-        else if (chr > FIRST_OF_TWO_BYTES_SEQ) sz = 2;
-        else sz = 1;
+        size_t sz = u8seqlen((unsigned char) *u8str);
+        if(sz == 0) sz = 1;
         
         char32_t u32c = 0;
         switch(sz)
@@ -109,10 +100,88 @@ size_t u8to32(const char* u8str, char32_t* u32str)
     return runelen;
 }
 
+u32view u32view_from(const char32_t* u32str)
+{
+    return u32view_make(u32str, u32strlen(u32str));
+}
+
+void u32view_copy(char32_t* dest, u32view view)
+{
+    memcpy(dest, view.str, view.len * sizeof(char32_t));
+    dest[view.len] = '\0';
+}
+
+int8_t u32view_eq(u32view view_a, u32view view_b)
+{
+    return view_a.len == view_b.len && 
+        memcmp(view_a.str, view_b.str, view_a.len * sizeof(char32_t)) == 0;
+}
+
+#define HASH_SEED 0x243F6A8885A308D3ULL
+#define HASH_PRIME_1 0x9E3779B97F4A7C15ULL
+#define HASH_PRIME_2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// Multiply-rotate hash over pairs of 32bit units with a murmur3
+// finalizer, so every input bit reaches the low bits.
+uint64_t u32view_hash(u32view view)
+{
+    const char32_t* key = view.str;
+    size_t len = view.len;
+    uint64_t hsh = HASH_SEED ^ ((uint64_t) len * HASH_PRIME_2);
+    size_t i = 0;
+    for(;i + 2 <= len;i += 2)
+    {
+        uint64_t chunk = (uint64_t) key[i] | ((uint64_t) key[i+1] << 32);
+        hsh = rotl64(hsh ^ (chunk * HASH_PRIME_2), 31) * HASH_PRIME_1;
+    }
+    if(i < len) hsh = rotl64(hsh ^ ((uint64_t) key[i] * HASH_PRIME_2), 31) * HASH_PRIME_1;
+
+    hsh ^= hsh >> 33;
+    hsh *= 0xFF51AFD7ED558CCDULL;
+    hsh ^= hsh >> 33;
+    hsh *= 0xC4CEB9FE1A85EC53ULL;
+    hsh ^= hsh >> 33;
+    return hsh;
+}
+
+u32view u32view_join(char32_t* dest, u32view fst, u32view snd)
+{
+    memcpy(dest, fst.str, fst.len * sizeof(char32_t));
+    memcpy(dest + fst.len, snd.str, snd.len * sizeof(char32_t));
+    dest[fst.len + snd.len] = '\0';
+    return u32view_make(dest, fst.len + snd.len);
+}
+
+size_t u8to32_n(const char* u8str, size_t bytelen, char32_t* u32str)
+{
+    const unsigned char* src = (const unsigned char*) u8str;
+    const unsigned char* end = src + bytelen;
+    size_t runelen = 0;
+
+    while(src < end)
+    {
+        size_t sz = u8seqlen(*src);
+        if(sz == 0) sz = 1;
+        if(sz > (size_t) (end - src)) sz = end - src;
+
+        char32_t u32c = 0;
+        for(size_t i=0;i<sz;i++) u32c = (u32c << 8) | *src++;
+        u32str[runelen++] = u32c;
+    }
+    u32str[runelen] = '\0';
+    return runelen;
+}
+
 size_t u32strmblen(const char32_t* u32str)
 {
     size_t size_of_u8str = 0;
-    for(int i=0; i<u32strlen(u32str);i++)
+    for(size_t i=0; u32str[i];i++)
     {
         if(u32str[i] >= FOUR_BYTES) size_of_u8str += 4;
         else if(u32str[i] >= THREE_BYTES) size_of_u8str += 3;
@@ -128,8 +197,7 @@ size_t u32to8(const char32_t* u32str, char* u8str)
     // iterate through every byte of u32str with bytepos
     // every non-zero byte is transfered to the next position (j) 
     // in u8str
-    size_t j = 0;
-    for(size_t i=0;i<u32strlen(u32str);i++)
+    for(size_t i=0;u32str[i];i++)
     {
         if(u32str[i] >= FOUR_BYTES) 
         {
@@ -156,3 +224,151 @@ size_t u32to8(const char32_t* u32str, char* u8str)
     return 0;
 }
 
+
+// Widens 16 ASCII bytes at src into 16 code points at dst. Returns 0
+// without writing if any byte is not ASCII.
+static inline int
+ascii_block_to32(const unsigned char* src, char32_t* dst)
+{
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*) src);
+    if(_mm_movemask_epi8(bytes)) return 0;
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+    _mm_storeu_si128((__m128i*) dst, _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128((__m128i*) (dst + 4), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128((__m128i*) (dst + 8), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128((__m128i*) (dst + 12), _mm_unpackhi_epi16(hi, zero));
+    return 1;
+#else
+    uint64_t a, b;
+    memcpy(&a, src, 8);
+    memcpy(&b, src + 8, 8);
+    if((a | b) & 0x8080808080808080ULL) return 0;
+    for(int i=0;i<16;i++) dst[i] = src[i];
+    return 1;
+#endif
+}
+
+size_t u8to32_utf(const char* u8str, size_t bytelen, char32_t* u32str, size_t* err_pos)
+{
+    const unsigned char* src = (const unsigned char*) u8str;
+    const unsigned char* end = src + bytelen;
+    const unsigned char* seq;
+    char32_t* dst = u32str;
+
+    while(src < end)
+    {
+        if(end - src >= 16 && ascii_block_to32(src, dst))
+        {
+            src += 16;
+            dst += 16;
+            continue;
+        }
+
+        seq = src;
+        unsigned char chr = *src++;
+        if(chr < 0x80)
+        {
+            *dst++ = chr;
+            continue;
+        }
+
+        size_t sz = u8seqlen(chr);
+        if(sz == 0) goto invalid;
+        size_t extra = sz - 1;
+        char32_t u32c = chr & (0x7F >> sz);
+        char32_t min = sz == 2 ? 0x80 : sz == 3 ? 0x800 : 0x10000;
+
+        if((size_t) (end - src) < extra) goto invalid;
+        for(size_t i=0;i<extra;i++)
+        {
+            if((src[i] & 0xC0) != 0x80) goto invalid;
+            u32c = (u32c << 6) | (src[i] & 0x3F);
+        }
+        if(u32c < min || u32c > 0x10FFFF || (u32c >= 0xD800 && u32c <= 0xDFFF))
+            goto invalid;
+
+        src += extra;
+        *dst++ = u32c;
+    }
+    *dst = '\0';
+    return dst - u32str;
+
+invalid:
+    if(err_pos != NULL) *err_pos = seq - (const unsigned char*) u8str;
+    return CU32_INVALID;
+}
+
+// Narrows 16 code points at src into 16 bytes at dst. Returns 0
+// without writing if any of them is not ASCII.
+static inline int
+ascii_block_to8(const char32_t* src, char* dst)
+{
+#ifdef __SSE2__
+    __m128i a = _mm_loadu_si128((const __m128i*) src);
+    __m128i b = _mm_loadu_si128((const __m128i*) (src + 4));
+    __m128i c = _mm_loadu_si128((const __m128i*) (src + 8));
+    __m128i d = _mm_loadu_si128((const __m128i*) (src + 12));
+    __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    __m128i high = _mm_andnot_si128(_mm_set1_epi32(0x7F), any);
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(high, _mm_setzero_si128())) != 0xFFFF) return 0;
+    __m128i ab = _mm_packs_epi32(a, b);
+    __m128i cd = _mm_packs_epi32(c, d);
+    _mm_storeu_si128((__m128i*) dst, _mm_packus_epi16(ab, cd));
+    return 1;
+#else
+    char32_t any = 0;
+    for(int i=0;i<16;i++) any |= src[i];
+    if(any & ~(char32_t) 0x7F) return 0;
+    for(int i=0;i<16;i++) dst[i] = (char) src[i];
+    return 1;
+#endif
+}
+
+size_t u32to8_utf(const char32_t* u32str, size_t len, char* u8str, size_t* err_pos)
+{
+    unsigned char* dst = (unsigned char*) u8str;
+    size_t i = 0;
+
+    while(i < len)
+    {
+        if(len - i >= 16 && ascii_block_to8(u32str + i, (char*) dst))
+        {
+            i += 16;
+            dst += 16;
+            continue;
+        }
+
+        char32_t u32c = u32str[i];
+        if(u32c < 0x80) *dst++ = u32c;
+        else if(u32c < 0x800)
+        {
+            *dst++ = 0xC0 | (u32c >> 6);
+            *dst++ = 0x80 | (u32c & 0x3F);
+        }
+        else if(u32c < 0x10000)
+        {
+            if(u32c >= 0xD800 && u32c <= 0xDFFF) goto invalid;
+            *dst++ = 0xE0 | (u32c >> 12);
+            *dst++ = 0x80 | ((u32c >> 6) & 0x3F);
+            *dst++ = 0x80 | (u32c & 0x3F);
+        }
+        else if(u32c <= 0x10FFFF)
+        {
+            *dst++ = 0xF0 | (u32c >> 18);
+            *dst++ = 0x80 | ((u32c >> 12) & 0x3F);
+            *dst++ = 0x80 | ((u32c >> 6) & 0x3F);
+            *dst++ = 0x80 | (u32c & 0x3F);
+        }
+        else goto invalid;
+        i++;
+    }
+    *dst = '\0';
+    return (char*) dst - u8str;
+
+invalid:
+    if(err_pos != NULL) *err_pos = i;
+    return CU32_INVALID;
+}
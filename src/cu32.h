@@ -7,7 +7,10 @@
 /* CU32
  * Rotinas para conversão de strings em utf8 para
  * strings de caracteres de largura fixa de 32bits.
- * Não há conversão garantida para utf32 no momento.
+ * As rotinas u8to32/u32to8 usam o modo legado, que guarda
+ * os bytes UTF8 de cada caractere empacotados em 32bits.
+ * u8to32_utf/u32to8_utf convertem para pontos de código
+ * Unicode (UTF32) com validação.
  * Use para facilitar acesso randômico a caracteres 
  * unicode internamente ao programa.
  * 
@@ -20,6 +23,20 @@
 #define __CU32_H__
 
 #include <uchar.h>
+#include <stdint.h>
+
+// Retorna o tamanho, de 1 a 4 bytes, da sequência UTF8 iniciada por
+// lead, ou 0 se lead não inicia sequência válida: bytes de
+// continuação, 0xC0, 0xC1 e acima de 0xF4. Todas as rotinas que
+// dividem ou decodificam UTF8 classificam o primeiro byte por aqui.
+static inline size_t u8seqlen(unsigned char lead)
+{
+    if(lead < 0x80) return 1;
+    if(lead >= 0xC2 && lead <= 0xDF) return 2;
+    if(lead >= 0xE0 && lead <= 0xEF) return 3;
+    if(lead >= 0xF0 && lead <= 0xF4) return 4;
+    return 0;
+}
 
 // Retorna o número de caracteres em uma string codificada
 // em UTF8
@@ -63,9 +80,73 @@ int8_t u32streq(const char32_t* str_a, const char32_t* str_b);
 // u32str = buffer previamente alocado que receberá a string convertida.
 size_t u8to32(const char* u8str, char32_t* u32str);
 
+// Igual a u8to32, mas converte exatamente bytelen bytes, que não
+// precisam terminar em '\0'. Percorre a entrada uma única vez.
+// u8str = bytes codificados em UTF8
+// bytelen = número de bytes a converter
+// u32str = buffer com ao menos bytelen + 1 posições.
+size_t u8to32_n(const char* u8str, size_t bytelen, char32_t* u32str);
+
 // Converte uma string de caracteres de largura fixa para uma 
 // string codificada em UTF8.
 // u32str = string padrão C codificada em largura fixa de 32bits
 // u8str = buffer previamente alocado que recebeá a string convertida.
 size_t u32to8(const char32_t* u32str, char* u8str);
+
+// Visão de uma string de caracteres de 32bits que carrega seu
+// tamanho, para que nenhuma operação precise procurar o '\0'.
+// str não precisa terminar em '\0'.
+typedef struct u32view
+{
+    const char32_t* str;
+    size_t len;
+} u32view;
+
+// Cria uma visão de uma string terminada em '\0', medindo-a uma vez.
+u32view u32view_from(const char32_t* u32str);
+
+// Cria uma visão dos len primeiros caracteres de u32str.
+static inline u32view u32view_make(const char32_t* u32str, size_t len)
+{
+    u32view view = { u32str, len };
+    return view;
+}
+
+// Copia a visão para dest e termina com '\0'. dest precisa de
+// view.len + 1 posições.
+void u32view_copy(char32_t* dest, u32view view);
+
+// Verifica igualdade entre visões. Retorna 0 se diferente e 1 se igual.
+int8_t u32view_eq(u32view view_a, u32view view_b);
+
+// Hash de 64bits do conteúdo da visão.
+uint64_t u32view_hash(u32view view);
+
+// Escreve fst seguida de snd em dest, terminada em '\0', e retorna a
+// visão resultante. dest precisa de fst.len + snd.len + 1 posições.
+u32view u32view_join(char32_t* dest, u32view fst, u32view snd);
+
+// Valor de retorno de u8to32_utf e u32to8_utf para entrada inválida.
+#define CU32_INVALID ((size_t) -1)
+
+// Converte bytelen bytes UTF8 em pontos de código Unicode, com
+// caminho vetorizado (SSE2) para trechos ASCII. Rejeita sequências
+// truncadas, mal formadas ou longas demais, surrogates e valores
+// acima de U+10FFFF.
+// Retorna o número de caracteres escritos (seguido de '\0') ou
+// CU32_INVALID; nesse caso err_pos, se não for NULL, recebe o offset
+// do primeiro byte inválido.
+// u8str = bytes codificados em UTF8
+// bytelen = número de bytes a converter
+// u32str = buffer com ao menos bytelen + 1 posições.
+size_t u8to32_utf(const char* u8str, size_t bytelen, char32_t* u32str, size_t* err_pos);
+
+// Converte len pontos de código Unicode em UTF8, com caminho
+// vetorizado para trechos ASCII. Retorna o número de bytes escritos
+// (seguido de '\0') ou CU32_INVALID para surrogates e valores acima
+// de U+10FFFF; nesse caso err_pos recebe o índice do caractere.
+// u32str = pontos de código
+// len = número de caracteres
+// u8str = buffer com ao menos 4 * len + 1 bytes.
+size_t u32to8_utf(const char32_t* u32str, size_t len, char* u8str, size_t* err_pos);
 #endif
@@ -1,3 +1,5 @@
+// pthread barriers are POSIX, not C11
+#define _POSIX_C_SOURCE 200809L
 #include <stdbool.h>
 #include <uchar.h>
 #include <stdint.h>
@@ -5,7 +7,14 @@
 #include <float.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "lexicon.h"
 #include "lexhnd.h"
 #include "cu32.h"
@@ -24,66 +33,131 @@ u64_arr_sum(uint64_t* arr, size_t sz)
     return sum;
 }
 
-#define ALPHABET_INIT_LENGTH 100
-#define ALPHABET_RESIZE_RATE 0.8
+#define ALPHABET_INIT_LENGTH 128
+// Characters below this are found by direct indexing; the rest go
+// through a hash table. Characters are packed UTF8 (see cu32.h), so
+// the direct range holds ASCII and the two byte sequences, 0xC280 to
+// 0xDFBF, which are U+0080 to U+07FF: Latin, Greek, Cyrillic, Hebrew
+// and Arabic. Three and four byte sequences, CJK among them, pack
+// to 0xE0A080 and above and are always hashed.
+#define ALPHABET_DIRECT_RANGE 0x10000
+#define ALPHABET_HASHED_INIT_CAPACITY 64
+#define ALPHABET_HASHED_LOAD_FACTOR 0.5
+#define ALPHABET_NO_ID UINT32_MAX
 
 
+// Characters of the corpus under dense IDs, numbered in order of first
+// appearance
 typedef struct 
 lexhnd_alphabet
 {
     char32_t* alphabet;
     size_t alphabet_sz;
+    size_t capacity;
     uint64_t* char_counts;
+    // Code length of each character, filled by alphabet_score once the
+    // counts are final
+    double* char_costs;
+    // ID of each character below ALPHABET_DIRECT_RANGE
+    uint32_t* direct_ids;
+    // Open addressing table for the characters above it
+    char32_t* hashed_chars;
+    uint32_t* hashed_ids;
+    size_t hashed_capacity;
+    size_t hashed_occupancy;
 } alphabet;
 
-static void 
-alphabet_resize(alphabet* ab)
+static inline size_t
+alphabet_hash(char32_t character, size_t capacity)
+{
+    return ((uint32_t) character * 0x9E3779B1u) & (capacity - 1);
+}
+
+// Slot of character in the hashed table, or of the empty slot where
+// it would go
+static size_t
+alphabet_hashed_slot(alphabet* ab, char32_t character)
 {
-    size_t new_alphabet_sz = 2 * ab->alphabet_sz; 
-    char32_t* new_alphabet = calloc(2 * ab->alphabet_sz,sizeof(char32_t));
-    if(new_alphabet == NULL) abort();
+    size_t mask = ab->hashed_capacity - 1;
+    size_t slot = alphabet_hash(character,ab->hashed_capacity);
+    while(ab->hashed_ids[slot] != ALPHABET_NO_ID && ab->hashed_chars[slot] != character) 
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+static void
+alphabet_rehash(alphabet* ab)
+{
+    char32_t* old_chars = ab->hashed_chars;
+    uint32_t* old_ids = ab->hashed_ids;
+    size_t old_capacity = ab->hashed_capacity;
+
+    ab->hashed_capacity = 2 * old_capacity;
+    ab->hashed_chars = malloc(ab->hashed_capacity * sizeof(char32_t));
+    ab->hashed_ids = malloc(ab->hashed_capacity * sizeof(uint32_t));
+    if(ab->hashed_chars == NULL || ab->hashed_ids == NULL) abort();
+    for(size_t i=0;i<ab->hashed_capacity;i++) ab->hashed_ids[i] = ALPHABET_NO_ID;
 
-    size_t i = 0;
-    while(new_alphabet[i])
+    for(size_t i=0;i<old_capacity;i++)
     {
-        new_alphabet[i] = ab->alphabet[i];
-        i++;
+        if(old_ids[i] == ALPHABET_NO_ID) continue;
+        size_t slot = alphabet_hashed_slot(ab,old_chars[i]);
+        ab->hashed_chars[slot] = old_chars[i];
+        ab->hashed_ids[slot] = old_ids[i];
     }
+    free(old_chars);
+    free(old_ids);
+}
 
-    free(ab->alphabet);
-    ab->alphabet = new_alphabet;
+// Dense ID of character, ALPHABET_NO_ID if it is not in the alphabet
+static inline uint32_t
+alphabet_id(alphabet* ab, char32_t character)
+{
+    if(character < ALPHABET_DIRECT_RANGE) return ab->direct_ids[character];
+    return ab->hashed_ids[alphabet_hashed_slot(ab,character)];
 }
 
 static void 
-alphabet_add(alphabet* ab, char32_t character)
+alphabet_resize(alphabet* ab)
 {
-    for(size_t i=0; i<ab->alphabet_sz;i++)
+    ab->capacity = 2 * ab->capacity;
+    ab->alphabet = realloc(ab->alphabet,ab->capacity * sizeof(char32_t));
+    ab->char_counts = realloc(ab->char_counts,ab->capacity * sizeof(uint64_t));
+    if(ab->alphabet == NULL || ab->char_counts == NULL) abort();
+}
+
+// Counts count occurrences of character and returns its ID
+static uint32_t 
+alphabet_add(alphabet* ab, char32_t character, uint64_t count)
+{
+    uint32_t* id;
+    if(character < ALPHABET_DIRECT_RANGE) id = &ab->direct_ids[character];
+    else
     {
-        if(ab->alphabet[i] == character) 
-        {
-            ab->char_counts[i]++;
-            return;
-        }
-        if(ab->alphabet[i] == 0)
+        size_t slot = alphabet_hashed_slot(ab,character);
+        if(ab->hashed_ids[slot] == ALPHABET_NO_ID)
         {
-            if((float) i > ALPHABET_RESIZE_RATE * ab->alphabet_sz) 
-                alphabet_resize(ab); 
-            ab->alphabet[i] = character;
-            ab->char_counts[i]++;
-            return;
+            if((float) (ab->hashed_occupancy + 1) / ab->hashed_capacity > ALPHABET_HASHED_LOAD_FACTOR)
+            {
+                alphabet_rehash(ab);
+                slot = alphabet_hashed_slot(ab,character);
+            }
+            ab->hashed_chars[slot] = character;
+            ab->hashed_occupancy++;
         }
+        id = &ab->hashed_ids[slot];
     }
-}
 
-static void 
-alphabet_add_word(alphabet* ab, char32_t* word)
-{
-    while(*word)
+    if(*id == ALPHABET_NO_ID)
     {
-        alphabet_add(ab,*word);
-        word++;
+        if(ab->alphabet_sz == ab->capacity) alphabet_resize(ab);
+        *id = ab->alphabet_sz;
+        ab->alphabet[ab->alphabet_sz] = character;
+        ab->char_counts[ab->alphabet_sz] = 0;
+        ab->alphabet_sz++;
     }
-    assert(*word == 0);
+    ab->char_counts[*id] += count;
+    return *id;
 }
 
 static alphabet* 
@@ -92,10 +166,20 @@ alphabet_create()
     alphabet* ab = malloc(sizeof(alphabet));
     if(ab == NULL) abort();
 
-    ab->alphabet_sz = ALPHABET_INIT_LENGTH; 
-    ab->alphabet = calloc(ALPHABET_INIT_LENGTH,sizeof(char32_t));
-    ab->char_counts = calloc(ALPHABET_INIT_LENGTH,sizeof(uint64_t));
-    if(ab-> alphabet == NULL || ab->char_counts == NULL) abort();
+    ab->alphabet_sz = 0; 
+    ab->capacity = ALPHABET_INIT_LENGTH; 
+    ab->alphabet = malloc(ALPHABET_INIT_LENGTH * sizeof(char32_t));
+    ab->char_counts = malloc(ALPHABET_INIT_LENGTH * sizeof(uint64_t));
+    ab->char_costs = NULL;
+    ab->direct_ids = malloc(ALPHABET_DIRECT_RANGE * sizeof(uint32_t));
+    ab->hashed_capacity = ALPHABET_HASHED_INIT_CAPACITY;
+    ab->hashed_occupancy = 0;
+    ab->hashed_chars = malloc(ALPHABET_HASHED_INIT_CAPACITY * sizeof(char32_t));
+    ab->hashed_ids = malloc(ALPHABET_HASHED_INIT_CAPACITY * sizeof(uint32_t));
+    if(ab->alphabet == NULL || ab->char_counts == NULL || ab->direct_ids == NULL 
+            || ab->hashed_chars == NULL || ab->hashed_ids == NULL) abort();
+    for(size_t i=0;i<ALPHABET_DIRECT_RANGE;i++) ab->direct_ids[i] = ALPHABET_NO_ID;
+    for(size_t i=0;i<ALPHABET_HASHED_INIT_CAPACITY;i++) ab->hashed_ids[i] = ALPHABET_NO_ID;
 
     return ab;
 }
@@ -106,120 +190,245 @@ alphabet_free(alphabet* ab)
 {
     free(ab->alphabet);
     free(ab->char_counts);
+    free(ab->char_costs);
+    free(ab->direct_ids);
+    free(ab->hashed_chars);
+    free(ab->hashed_ids);
     free(ab);
 }
 
 
-static double 
-alphabet_char_cost(alphabet* ab, uint64_t char_count)
+static void 
+alphabet_score(alphabet* ab)
 {
     uint64_t total_char_counts = u64_arr_sum(ab->char_counts, ab->alphabet_sz);
-    
-    return -1 * log2((double) char_count/total_char_counts);
+
+    free(ab->char_costs);
+    ab->char_costs = malloc(ab->alphabet_sz * sizeof(double));
+    if(ab->char_costs == NULL) abort();
+    for(size_t i=0;i<ab->alphabet_sz;i++)
+    {
+        ab->char_costs[i] = -1 * log2((double) ab->char_counts[i]/total_char_counts);
+    }
 }
 
 
-static double 
-alphabet_get_word_cost(alphabet* ab, char32_t* word)
+#define CORPUS_INIT_SYMBOLS 4096
+#define CORPUS_INIT_WORDS 1024
+
+// Symbol IDs of every word stored back to back in one buffer, each as
+// narrow as the alphabet allows. The buffer is widened in place when
+// the alphabet outgrows it.
+struct lexhnd_corpus
 {
-    double total_cost = 0;
-    bool found = false;
-    while(*word)
+    alphabet* ab;
+    uint8_t* symbols;
+    uint8_t width;
+    size_t n_symbols;
+    size_t symbols_capacity;
+    // Word i holds the symbols from offsets[i] up to offsets[i+1]
+    size_t* offsets;
+    // Occurrences of each word, NULL while every word occurs once
+    uint64_t* weights;
+    size_t n_words;
+    size_t words_capacity;
+};
+
+static inline void
+corpus_store(uint8_t* symbols, uint8_t width, size_t pos, uint32_t id)
+{
+    switch(width)
     {
-        size_t i = 0;
-        while(ab->alphabet[i])
-        { 
-            if(ab->alphabet[i] == *word)
-            {
-                total_cost += alphabet_char_cost(ab,ab->char_counts[i]);
-                found = true;
-                break;
-            }
-            i++;
-        }
-        if(!found) return DBL_MAX;
-        found = false;  
-        word++;
+        case 1: symbols[pos] = (uint8_t) id; break;
+        case 2: ((uint16_t*) symbols)[pos] = (uint16_t) id; break;
+        default: ((uint32_t*) symbols)[pos] = id; break;
     }
-    return total_cost;
 }
 
-static void 
-alphabet_setup(alphabet* ab, char32_t** corpus, size_t corpus_sz)
+static void
+corpus_widen(lexhnd_corpus* corpus, uint8_t width)
 {
-    for(size_t i=0;i<corpus_sz;i++)
-    {
-        alphabet_add_word(ab,corpus[i]);
-    }
+    uint8_t* symbols = malloc(corpus->symbols_capacity * width);
+    if(symbols == NULL) abort();
+    minseg_text old = { corpus->symbols, corpus->n_symbols, corpus->width, NULL };
+    for(size_t i=0;i<corpus->n_symbols;i++) 
+        corpus_store(symbols,width,i,minseg_text_at(&old,i));
+    free(corpus->symbols);
+    corpus->symbols = symbols;
+    corpus->width = width;
+}
+
+lexhnd_corpus*
+lexhnd_corpus_create()
+{
+    lexhnd_corpus* corpus = malloc(sizeof(lexhnd_corpus));
+    if(corpus == NULL) abort();
+    corpus->ab = alphabet_create();
+    corpus->width = 1;
+    corpus->n_symbols = 0;
+    corpus->symbols_capacity = CORPUS_INIT_SYMBOLS;
+    corpus->symbols = malloc(CORPUS_INIT_SYMBOLS);
+    corpus->n_words = 0;
+    corpus->words_capacity = CORPUS_INIT_WORDS;
+    corpus->offsets = malloc((CORPUS_INIT_WORDS + 1) * sizeof(size_t));
+    if(corpus->symbols == NULL || corpus->offsets == NULL) abort();
+    corpus->offsets[0] = 0;
+    corpus->weights = NULL;
+    return corpus;
+}
+
+void
+lexhnd_corpus_add(lexhnd_corpus* corpus, u32view word)
+{
+    lexhnd_corpus_add_weighted(corpus,word,1);
 }
 
-static double 
-get_lexicon_bitlength(alphabet* ab, lexicon* lex)
+void
+lexhnd_corpus_add_weighted(lexhnd_corpus* corpus, u32view word, uint64_t count)
 {
-    double bitlen = 0;
-    size_t lexlen = lex->occupancy;
-    litem** items = malloc(lexlen * sizeof(litem*));
-    lexicon_get_items(lex,items);
-    for(size_t i=0;i<lexlen;i++)
+    if(corpus->n_words == corpus->words_capacity)
+    {
+        corpus->words_capacity = 2 * corpus->words_capacity;
+        corpus->offsets = realloc(corpus->offsets, (corpus->words_capacity + 1) * sizeof(size_t));
+        if(corpus->offsets == NULL) abort();
+        if(corpus->weights != NULL)
+        {
+            corpus->weights = realloc(corpus->weights, corpus->words_capacity * sizeof(uint64_t));
+            if(corpus->weights == NULL) abort();
+        }
+    }
+    if(count != 1 && corpus->weights == NULL)
+    {
+        corpus->weights = malloc(corpus->words_capacity * sizeof(uint64_t));
+        if(corpus->weights == NULL) abort();
+        for(size_t i=0;i<corpus->n_words;i++) corpus->weights[i] = 1;
+    }
+    if(corpus->weights != NULL) corpus->weights[corpus->n_words] = count;
+    if(corpus->n_symbols + word.len > corpus->symbols_capacity)
+    {
+        while(corpus->n_symbols + word.len > corpus->symbols_capacity) 
+            corpus->symbols_capacity = 2 * corpus->symbols_capacity;
+        corpus->symbols = realloc(corpus->symbols, corpus->symbols_capacity * corpus->width);
+        if(corpus->symbols == NULL) abort();
+    }
+
+    for(size_t i=0;i<word.len;i++)
     {
-        bitlen += alphabet_get_word_cost(ab,items[i]->key);
+        uint32_t id = alphabet_add(corpus->ab,word.str[i],count);
+        if(corpus->width == 1 && id > UINT8_MAX) corpus_widen(corpus,2);
+        if(corpus->width == 2 && id > UINT16_MAX) corpus_widen(corpus,4);
+        corpus_store(corpus->symbols,corpus->width,corpus->n_symbols++,id);
     }
-    return bitlen;
+    corpus->n_words++;
+    corpus->offsets[corpus->n_words] = corpus->n_symbols;
 }
 
+size_t
+lexhnd_corpus_size(const lexhnd_corpus* corpus)
+{
+    return corpus->n_words;
+}
+
+size_t
+lexhnd_corpus_bytes(const lexhnd_corpus* corpus)
+{
+    size_t bytes = corpus->n_symbols * corpus->width + (corpus->n_words + 1) * sizeof(size_t);
+    if(corpus->weights != NULL) bytes += corpus->n_words * sizeof(uint64_t);
+    return bytes;
+}
+
+void
+lexhnd_corpus_free(lexhnd_corpus* corpus)
+{
+    alphabet_free(corpus->ab);
+    free(corpus->symbols);
+    free(corpus->offsets);
+    free(corpus->weights);
+    free(corpus);
+}
+
+static inline uint64_t
+corpus_weight(const lexhnd_corpus* corpus, size_t i)
+{
+    return corpus->weights == NULL ? 1 : corpus->weights[i];
+}
+
+// Word i as a text readable by minseg
+static inline minseg_text
+corpus_word(const lexhnd_corpus* corpus, size_t i)
+{
+    size_t begin = corpus->offsets[i];
+    minseg_text text = { 
+        corpus->symbols + begin * corpus->width, 
+        corpus->offsets[i+1] - begin, 
+        corpus->width, 
+        corpus->ab->alphabet 
+    };
+    return text;
+}
+
+
+// Segmentation as a stream of tokens. A token is the index node of a
+// segment or, for a segment missing from the index, the alphabet ID of
+// its character tagged with TOKEN_CHAR. Packed UTF8 characters can use
+// every bit, IDs stay far below the tag. Joined parses hold two tokens
+// per pair, the second TOKEN_NONE when a word ends on an unpaired
+// segment.
+#define TOKEN_CHAR 0x80000000u
+#define TOKEN_NONE UINT32_MAX
 
 typedef struct lexhnd_parse
 {
-    char32_t* segments;
+    uint32_t* tokens;
     size_t size;
     size_t pos;
 } parse;
 
-#define PARSE_SEGMENTS_BUFFER_INIT_SZ 2000
+#define PARSE_TOKENS_BUFFER_INIT_SZ 2000
 
 static parse*
 parse_create()
 {
     parse* prs = malloc(sizeof(parse));
     if(prs == NULL) abort();
-    prs->segments = malloc(PARSE_SEGMENTS_BUFFER_INIT_SZ * sizeof(char32_t));
-    if(prs->segments == NULL) abort();
-    prs->size = PARSE_SEGMENTS_BUFFER_INIT_SZ;
+    prs->tokens = malloc(PARSE_TOKENS_BUFFER_INIT_SZ * sizeof(uint32_t));
+    if(prs->tokens == NULL) abort();
+    prs->size = PARSE_TOKENS_BUFFER_INIT_SZ;
     prs->pos = 0;
     return prs;
 }
 
-static char32_t*
-parse_pop(parse* parse)
+static inline void
+parse_push(parse* parse, uint32_t token)
 {
-    if(!parse->pos) return parse->segments;
-    parse->pos--;
-    while(1)
+    if(parse->pos == parse->size) 
     {
-        if(!parse->pos) return parse->segments;
-        parse->pos--;
-        if(!parse->pos) return parse->segments;
-        if(!parse->segments[parse->pos]) 
-        {
-            parse->pos++;
-            return parse->segments + parse->pos;
-        }
+        parse->size = 2 * parse->size;
+        parse->tokens = realloc(parse->tokens, parse->size * sizeof(uint32_t));
+        if(parse->tokens == NULL) abort();  
     }
+    parse->tokens[parse->pos++] = token;
 }
 
+static inline uint32_t
+span_token(const minseg_text* sentence, const minseg_span* span)
+{
+    if(span->entry != MINSEG_NO_ENTRY) return span->entry;
+    // only single characters fall outside the index
+    minseg_text ids = *sentence;
+    ids.symbols = NULL;
+    return TOKEN_CHAR | minseg_text_at(&ids,span->offset);
+}
 
+// Adds the segments of a sentence to the parse joined in pairs
 static void
-parse_add(parse* parse, char32_t* str)
+parse_add_joined(parse* parse, const minseg_text* sentence, minseg_spans* mseg)
 {
-    if(parse->pos > parse->size - 50) 
-    {
-        parse->size = 2 * parse->size;
-        parse->segments = realloc(parse->segments, parse->size * sizeof(char32_t));
-        if(parse->segments == NULL) abort();  
+    for(size_t j=0;j<mseg->size;j+=2)
+    { 
+        parse_push(parse,span_token(sentence,&mseg->spans[j]));
+        parse_push(parse,j+1 < mseg->size ? span_token(sentence,&mseg->spans[j+1]) : TOKEN_NONE);
     }
-    u32strcpy(parse->segments + parse->pos,str); 
-    parse->pos = parse->pos + u32strlen(str) + 1;
-    
 }
 
 static void
@@ -231,35 +440,618 @@ parse_clear(parse* parse)
 static void
 parse_free(parse* parse)
 {
-    free(parse->segments);
+    free(parse->tokens);
     free(parse);
 }
 
+// Writes the characters of token to dest and returns their number
+static size_t
+token_spell(const minseg_index* index, const alphabet* ab, uint32_t token, char32_t* dest)
+{
+    if(token & TOKEN_CHAR)
+    {
+        dest[0] = ab->alphabet[token & ~TOKEN_CHAR];
+        dest[1] = 0;
+        return 1;
+    }
+    return minseg_index_key(index,token,dest);
+}
 
-static void 
-u32strjoin(char32_t* buffer, char32_t* fst, char32_t* snd)
+
+// Histogram of tokens or token pairs, keyed by (first << 32) | second
+#define TOKEN_COUNTS_INIT_CAPACITY 4096
+#define TOKEN_COUNTS_LOAD_FACTOR 0.5
+#define TOKEN_COUNTS_EMPTY UINT64_MAX
+
+typedef struct lexhnd_token_counts
+{
+    uint64_t* keys;
+    uint64_t* counts;
+    size_t capacity;
+    size_t occupancy;
+} token_counts;
+
+static inline size_t
+token_counts_slot(uint64_t key, size_t capacity)
+{
+    return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+static token_counts*
+token_counts_create()
+{
+    token_counts* tc = malloc(sizeof(token_counts));
+    if(tc == NULL) abort();
+    tc->capacity = TOKEN_COUNTS_INIT_CAPACITY;
+    tc->occupancy = 0;
+    tc->keys = malloc(TOKEN_COUNTS_INIT_CAPACITY * sizeof(uint64_t));
+    tc->counts = malloc(TOKEN_COUNTS_INIT_CAPACITY * sizeof(uint64_t));
+    if(tc->keys == NULL || tc->counts == NULL) abort();
+    for(size_t i=0;i<tc->capacity;i++) tc->keys[i] = TOKEN_COUNTS_EMPTY;
+    return tc;
+}
+
+static void
+token_counts_free(token_counts* tc)
+{
+    free(tc->keys);
+    free(tc->counts);
+    free(tc);
+}
+
+static void
+token_counts_add(token_counts* tc, uint64_t key, uint64_t count);
+
+static void
+token_counts_grow(token_counts* tc)
 {
-    size_t len_1 = u32strlen(fst);
-    size_t len_2 = u32strlen(snd);
+    uint64_t* old_keys = tc->keys;
+    uint64_t* old_counts = tc->counts;
+    size_t old_capacity = tc->capacity;
+
+    tc->capacity = 2 * old_capacity;
+    tc->occupancy = 0;
+    tc->keys = malloc(tc->capacity * sizeof(uint64_t));
+    tc->counts = malloc(tc->capacity * sizeof(uint64_t));
+    if(tc->keys == NULL || tc->counts == NULL) abort();
+    for(size_t i=0;i<tc->capacity;i++) tc->keys[i] = TOKEN_COUNTS_EMPTY;
+
+    for(size_t i=0;i<old_capacity;i++)
+    {
+        // pairs that dropped to zero are not carried over
+        if(old_keys[i] != TOKEN_COUNTS_EMPTY && old_counts[i]) 
+            token_counts_add(tc,old_keys[i],old_counts[i]);
+    }
+    free(old_keys);
+    free(old_counts);
+}
+
+static void
+token_counts_add(token_counts* tc, uint64_t key, uint64_t count)
+{
+    size_t mask = tc->capacity - 1;
+    size_t slot = token_counts_slot(key,tc->capacity);
+    while(tc->keys[slot] != TOKEN_COUNTS_EMPTY)
+    {
+        if(tc->keys[slot] == key) 
+        {
+            tc->counts[slot] += count;
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    tc->keys[slot] = key;
+    tc->counts[slot] = count;
+    tc->occupancy++;
+    if((double) tc->occupancy / tc->capacity >= TOKEN_COUNTS_LOAD_FACTOR) token_counts_grow(tc);
+}
+
+// Removes count from key, which must hold at least that much
+static void
+token_counts_sub(token_counts* tc, uint64_t key, uint64_t count)
+{
+    size_t mask = tc->capacity - 1;
+    size_t slot = token_counts_slot(key,tc->capacity);
+    while(tc->keys[slot] != key) slot = (slot + 1) & mask;
+    assert(tc->counts[slot] >= count);
+    tc->counts[slot] -= count;
+}
+
+// Adds every counted token, or pair of tokens spelled one after the
+// other, to lex. Different pairs may spell the same string; the
+// lexicon merges their counts.
+static void
+token_counts_to_lexicon(const token_counts* tc, const minseg_index* index, const alphabet* ab, 
+        lexicon* lex)
+{
+    char32_t* buffer = malloc((2 * index->max_key_length + 2) * sizeof(char32_t));
+    if(buffer == NULL) abort();
+    for(size_t i=0;i<tc->capacity;i++)
+    {
+        uint64_t key = tc->keys[i];
+        if(key == TOKEN_COUNTS_EMPTY || tc->counts[i] == 0) continue;
+        uint32_t first = (uint32_t) (key >> 32);
+        uint32_t second = (uint32_t) key;
+        size_t len = token_spell(index,ab,first,buffer);
+        if(second != TOKEN_NONE) len += token_spell(index,ab,second,buffer + len);
+        lexicon_add_view(lex,u32view_make(buffer,len),tc->counts[i]);
+    }
+    free(buffer);
+}
+
+
+// Segmentation passes over the corpus run on a fixed set of workers,
+// each owning a contiguous chunk of the corpus and its own parse. The
+// threads live as long as the run and meet the caller at a barrier
+// before and after each pass; the caller works the first chunk. The
+// index is only read during a pass. Costs are stored per word and
+// chunks are merged in corpus order, so the results do not depend on
+// the number of threads.
+typedef struct lexhnd_task
+{
+    struct lexhnd_workers* wk;
+    minseg_index* index;
+    const lexhnd_corpus* corpus;
+    size_t begin;
+    size_t end;
+    bool joined;
+    double* costs;
+    // Tokens each word added to prs
+    size_t* n_tokens;
+    parse* prs;
+    minseg_workspace* ws;
+    minseg_spans* mseg;
+} task;
+
+typedef struct lexhnd_workers
+{
+    size_t n_threads;
+    task* tasks;
+    // Threads of tasks 1 to n_threads - 1
+    pthread_t* threads;
+    pthread_barrier_t barrier;
+    bool quit;
+    double* costs;
+    size_t* n_tokens;
+} workers;
+
+static size_t
+workers_default_threads()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long n = (long) info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n > 0 ? (size_t) n : 1;
+}
+
+static void
+task_run(task* tk)
+{
+    minseg_spans* mseg = tk->mseg;
+    parse_clear(tk->prs);
+    for(size_t i=tk->begin;i<tk->end;i++)
+    {
+        minseg_text word = corpus_word(tk->corpus,i);
+        minseg_find_spans_text_with(tk->ws,tk->index,&word,mseg);
+        tk->costs[i] = mseg->cost;
+        size_t before = tk->prs->pos;
+        if(tk->joined) parse_add_joined(tk->prs,&word,mseg);
+        else
+        {
+            for(size_t j=0;j<mseg->size;j++)
+                parse_push(tk->prs,span_token(&word,&mseg->spans[j]));
+        }
+        tk->n_tokens[i] = tk->prs->pos - before;
+    }
+}
+
+static void*
+worker_loop(void* arg)
+{
+    task* tk = arg;
+    workers* wk = tk->wk;
+    for(;;)
+    {
+        pthread_barrier_wait(&wk->barrier);
+        if(wk->quit) break;
+        task_run(tk);
+        pthread_barrier_wait(&wk->barrier);
+    }
+    return NULL;
+}
+
+static workers*
+workers_create(size_t n_threads, size_t corpus_sz)
+{
+    workers* wk = malloc(sizeof(workers));
+    if(wk == NULL) abort();
+    if(n_threads == 0) n_threads = workers_default_threads();
+    wk->n_threads = n_threads;
+    wk->tasks = malloc(n_threads * sizeof(task));
+    wk->threads = malloc(n_threads * sizeof(pthread_t));
+    wk->costs = malloc((corpus_sz + 1) * sizeof(double));
+    wk->n_tokens = malloc((corpus_sz + 1) * sizeof(size_t));
+    if(wk->tasks == NULL || wk->threads == NULL || wk->costs == NULL || wk->n_tokens == NULL) abort();
+    for(size_t i=0;i<n_threads;i++) 
+    {
+        wk->tasks[i].wk = wk;
+        wk->tasks[i].prs = parse_create();
+        wk->tasks[i].ws = minseg_workspace_create();
+        wk->tasks[i].mseg = minseg_spans_create();
+    }
+    wk->quit = false;
+    if(n_threads > 1)
+    {
+        if(pthread_barrier_init(&wk->barrier,NULL,(unsigned) n_threads)) abort();
+        for(size_t t=1;t<n_threads;t++)
+            if(pthread_create(&wk->threads[t],NULL,worker_loop,&wk->tasks[t])) abort();
+    }
+    return wk;
+}
+
+static void
+workers_free(workers* wk)
+{
+    if(wk->n_threads > 1)
+    {
+        wk->quit = true;
+        pthread_barrier_wait(&wk->barrier);
+        for(size_t t=1;t<wk->n_threads;t++) pthread_join(wk->threads[t],NULL);
+        pthread_barrier_destroy(&wk->barrier);
+    }
+    for(size_t i=0;i<wk->n_threads;i++) 
+    {
+        parse_free(wk->tasks[i].prs);
+        minseg_workspace_free(wk->tasks[i].ws);
+        minseg_spans_free(wk->tasks[i].mseg);
+    }
+    free(wk->tasks);
+    free(wk->threads);
+    free(wk->costs);
+    free(wk->n_tokens);
+    free(wk);
+}
+
+// Tokens each word produced in the last joined pass. Word i holds the
+// tokens from offsets[i] up to offsets[i+1].
+typedef struct lexhnd_segment_cache
+{
+    uint32_t* tokens;
+    size_t* offsets;
+    size_t n_words;
+} segment_cache;
+
+static segment_cache*
+segment_cache_create(size_t n_words)
+{
+    segment_cache* cache = malloc(sizeof(segment_cache));
+    if(cache == NULL) abort();
+    cache->tokens = NULL;
+    cache->offsets = calloc(n_words + 1, sizeof(size_t));
+    if(cache->offsets == NULL) abort();
+    cache->n_words = n_words;
+    return cache;
+}
+
+static void
+segment_cache_free(segment_cache* cache)
+{
+    free(cache->tokens);
+    free(cache->offsets);
+    free(cache);
+}
+
+// Segments the whole corpus with index, leaving each chunk's segments
+// (joined in pairs if joined is set) in its task parse and the cost
+// of each word in wk->costs. Returns the sum of the costs.
+static double
+workers_segment(workers* wk, minseg_index* index, const lexhnd_corpus* corpus, size_t corpus_sz, 
+        bool joined)
+{
+    if(!index->scored) minseg_index_score(index);
+    size_t chunk = (corpus_sz + wk->n_threads - 1) / wk->n_threads;
+    for(size_t t=0;t<wk->n_threads;t++)
+    {
+        task* tk = &wk->tasks[t];
+        tk->index = index;
+        tk->corpus = corpus;
+        tk->begin = t * chunk < corpus_sz ? t * chunk : corpus_sz;
+        tk->end = tk->begin + chunk < corpus_sz ? tk->begin + chunk : corpus_sz;
+        tk->joined = joined;
+        tk->costs = wk->costs;
+        tk->n_tokens = wk->n_tokens;
+    }
+
+    // The barriers order the task setup before the pass and the
+    // results after it
+    if(wk->n_threads > 1) pthread_barrier_wait(&wk->barrier);
+    task_run(&wk->tasks[0]);
+    if(wk->n_threads > 1) pthread_barrier_wait(&wk->barrier);
+
+    double total = 0;
+    for(size_t i=0;i<corpus_sz;i++) total += wk->costs[i] * corpus_weight(corpus,i);
+    return total;
+}
+
+// Counts the segments left in the task parses by a pass that was not
+// joined, each as many times as its word occurs
+static token_counts*
+workers_count(workers* wk, const lexhnd_corpus* corpus)
+{
+    token_counts* tc = token_counts_create();
+    for(size_t t=0;t<wk->n_threads;t++)
+    {
+        const task* tk = &wk->tasks[t];
+        const uint32_t* stream = tk->prs->tokens;
+        for(size_t i=tk->begin;i<tk->end;i++)
+        {
+            uint64_t weight = corpus_weight(corpus,i);
+            for(size_t j=0;j<wk->n_tokens[i];j++)
+                token_counts_add(tc,((uint64_t) stream[j] << 32) | TOKEN_NONE,weight);
+            stream += wk->n_tokens[i];
+        }
+    }
+    return tc;
+}
+
+
+static inline uint64_t
+pair_key(const uint32_t* pair)
+{
+    return ((uint64_t) pair[0] << 32) | pair[1];
+}
+
+// Replaces the cached tokens with those left in the task parses by a
+// joined pass, updating the pair counts of the words whose tokens
+// changed; node IDs are stable because the index is only ever
+// extended, so the others cost a comparison.
+static void
+segment_cache_update(segment_cache* cache, workers* wk, const lexhnd_corpus* corpus, token_counts* pairs)
+{
+    size_t total = 0;
+    for(size_t t=0;t<wk->n_threads;t++) total += wk->tasks[t].prs->pos;
+    uint32_t* tokens = malloc((total + 1) * sizeof(uint32_t));
+    size_t* offsets = malloc((cache->n_words + 1) * sizeof(size_t));
+    if(tokens == NULL || offsets == NULL) abort();
+
     size_t pos = 0;
-    for(size_t i=0;i<len_1;i++)
+    for(size_t t=0;t<wk->n_threads;t++)
     {
-        buffer[pos] = fst[i];
-        pos++;
+        const task* tk = &wk->tasks[t];
+        const uint32_t* stream = tk->prs->tokens;
+        for(size_t i=tk->begin;i<tk->end;i++)
+        {
+            size_t n = wk->n_tokens[i];
+            offsets[i] = pos;
+            memcpy(tokens + pos, stream, n * sizeof(uint32_t));
+
+            const uint32_t* old = cache->tokens + cache->offsets[i];
+            size_t old_n = cache->offsets[i+1] - cache->offsets[i];
+            if(n != old_n || memcmp(old, stream, n * sizeof(uint32_t)))
+            {
+                uint64_t weight = corpus_weight(corpus,i);
+                for(size_t j=0;j<old_n;j+=2) token_counts_sub(pairs,pair_key(old + j),weight);
+                for(size_t j=0;j<n;j+=2) token_counts_add(pairs,pair_key(stream + j),weight);
+            }
+            stream += n;
+            pos += n;
+        }
     }
-    for(size_t i=0;i<len_2;i++)
+    offsets[cache->n_words] = pos;
+
+    free(cache->tokens);
+    free(cache->offsets);
+    cache->tokens = tokens;
+    cache->offsets = offsets;
+}
+
+
+// What a run keeps from one pass to the next
+typedef struct lexhnd_state
+{
+    minseg_index* index;
+    // Counts of the pairs in the last joined pass
+    token_counts* pairs;
+    // Last tokens of each word in the joined pass
+    segment_cache* cache;
+
+    // Prior of the lexicon the index holds. Each node caches the cost
+    // of spelling its key, its parent's plus that of its label, and
+    // key_costs sums it over the nodes with a count, listed in
+    // counted. Only nodes whose count crosses zero change the sum.
+    alphabet* ab;
+    double* spell_costs;
+    // Scratch of state_recount, zero between calls
+    uint64_t* next_counts;
+    size_t spelled_nodes;
+    size_t spell_capacity;
+    uint32_t* counted;
+    size_t n_counted;
+    size_t counted_capacity;
+    double key_costs;
+} state;
+
+static state*
+state_create(const lexhnd_corpus* corpus)
+{
+    state* st = malloc(sizeof(state));
+    if(st == NULL) abort();
+    st->index = NULL;
+    st->pairs = token_counts_create();
+    st->cache = segment_cache_create(corpus->n_words);
+    st->ab = corpus->ab;
+    st->spell_costs = NULL;
+    st->next_counts = NULL;
+    st->spelled_nodes = 0;
+    st->spell_capacity = 0;
+    st->counted = NULL;
+    st->n_counted = 0;
+    st->counted_capacity = 0;
+    st->key_costs = 0;
+    return st;
+}
+
+static void
+state_free(state* st)
+{
+    if(st->index != NULL) minseg_index_free(st->index);
+    token_counts_free(st->pairs);
+    segment_cache_free(st->cache);
+    free(st->spell_costs);
+    free(st->next_counts);
+    free(st->counted);
+    free(st);
+}
+
+// Caches the spelling cost of the nodes added to the index since the
+// last call, summing the character costs from the first character on
+static void
+state_spell_new_nodes(state* st)
+{
+    const minseg_index* index = st->index;
+    if(index->nodes_capacity > st->spell_capacity)
+    {
+        st->spell_capacity = index->nodes_capacity;
+        st->spell_costs = realloc(st->spell_costs, st->spell_capacity * sizeof(double));
+        st->next_counts = realloc(st->next_counts, st->spell_capacity * sizeof(uint64_t));
+        if(st->spell_costs == NULL || st->next_counts == NULL) abort();
+    }
+    for(size_t node=st->spelled_nodes;node<index->n_nodes;node++)
     {
-        buffer[pos] = snd[i];
-        pos++;
+        st->next_counts[node] = 0;
+        if(node == 0) 
+        {
+            st->spell_costs[node] = 0;
+            continue;
+        }
+        uint32_t id = alphabet_id(st->ab,index->labels[node]);
+        assert(id != ALPHABET_NO_ID);
+        st->spell_costs[node] = st->spell_costs[index->parents[node]] + st->ab->char_costs[id];
     }
-    buffer[pos] = '\0';  
+    st->spelled_nodes = index->n_nodes;
 }
 
-#define JOIN_BUFFER_SZ 100
+static void
+state_push_counted(state* st, uint32_t node)
+{
+    if(st->n_counted == st->counted_capacity)
+    {
+        st->counted_capacity = st->counted_capacity ? 2 * st->counted_capacity : 1024;
+        st->counted = realloc(st->counted, st->counted_capacity * sizeof(uint32_t));
+        if(st->counted == NULL) abort();
+    }
+    st->counted[st->n_counted++] = node;
+}
 
-static parse*
-iteration_zero(alphabet* ab, char32_t** corpus, size_t corpus_sz, 
-        lexhnd_result* res)
+// Charges the prior for every node of a new index that has a count
+static void
+state_track_index(state* st)
+{
+    state_spell_new_nodes(st);
+    st->n_counted = 0;
+    st->key_costs = 0;
+    for(size_t node=1;node<st->index->n_nodes;node++)
+    {
+        if(st->index->counts[node] == 0) continue;
+        st->key_costs += st->spell_costs[node];
+        state_push_counted(st,(uint32_t) node);
+    }
+}
+
+// Adds count occurrences of word to the index
+static void
+state_add_word(state* st, u32view word, uint64_t count)
+{
+    uint32_t node = minseg_index_add(st->index,word,0);
+    state_spell_new_nodes(st);
+    if(count == 0) return;
+    if(st->index->counts[node] == 0)
+    {
+        st->key_costs += st->spell_costs[node];
+        state_push_counted(st,node);
+    }
+    minseg_index_add_node(st->index,node,count);
+}
+
+// Sets the counts of the index to the counted tokens. Nodes whose
+// count stays above zero keep their share of the prior.
+static void
+state_recount(state* st, const token_counts* tc)
+{
+    minseg_index* index = st->index;
+    uint32_t* nodes = malloc((tc->occupancy + 1) * sizeof(uint32_t));
+    if(nodes == NULL) abort();
+
+    size_t n_nodes = 0;
+    for(size_t i=0;i<tc->capacity;i++)
+    {
+        uint64_t key = tc->keys[i];
+        if(key == TOKEN_COUNTS_EMPTY || tc->counts[i] == 0) continue;
+        uint32_t token = (uint32_t) (key >> 32);
+        if(token & TOKEN_CHAR)
+        {
+            char32_t character = st->ab->alphabet[token & ~TOKEN_CHAR];
+            token = minseg_index_add(index,u32view_make(&character,1),0);
+        }
+        nodes[n_nodes++] = token;
+    }
+    state_spell_new_nodes(st);
+    for(size_t i=0,k=0;i<tc->capacity;i++)
+    {
+        if(tc->keys[i] == TOKEN_COUNTS_EMPTY || tc->counts[i] == 0) continue;
+        st->next_counts[nodes[k++]] += tc->counts[i];
+    }
+
+    for(size_t j=0;j<st->n_counted;j++)
+    {
+        uint32_t node = st->counted[j];
+        if(st->next_counts[node]) continue;
+        st->key_costs -= st->spell_costs[node];
+        minseg_index_set_count(index,node,0);
+    }
+    st->n_counted = 0;
+    for(size_t k=0;k<n_nodes;k++)
+    {
+        uint32_t node = nodes[k];
+        // a node reached by two tokens is set on the first
+        if(st->next_counts[node] == 0) continue;
+        if(index->counts[node] == 0) st->key_costs += st->spell_costs[node];
+        minseg_index_set_count(index,node,st->next_counts[node]);
+        st->next_counts[node] = 0;
+        state_push_counted(st,node);
+    }
+    free(nodes);
+    minseg_index_score(index);
+}
+
+// Runs a segmentation pass with the state index. A joined pass caches
+// its tokens and updates the pair counts. Returns the sum of the word
+// costs.
+static double
+state_pass(state* st, workers* wk, const lexhnd_corpus* corpus, bool joined)
+{
+    double total = workers_segment(wk,st->index,corpus,corpus->n_words,joined);
+    if(joined) segment_cache_update(st->cache,wk,corpus,st->pairs);
+    return total;
+}
+
+static lexicon*
+state_candidates(const state* st)
+{
+    lexicon* candidates = lexicon_create();
+    token_counts_to_lexicon(st->pairs,st->index,st->ab,candidates);
+    return candidates;
+}
+
+// Returns the candidate lexicon of joined segments for the next
+// iteration
+static lexicon*
+iteration_zero(alphabet* ab, workers* wk, const lexhnd_corpus* corpus, 
+        lexhnd_result* res, state* st)
 {
     
     lexicon* lex = lexicon_create();
@@ -272,119 +1064,59 @@ iteration_zero(alphabet* ab, char32_t** corpus, size_t corpus_sz,
         lexicon_add(lex,letter,ab->char_counts[i]);
     }
 
-    double priors = get_lexicon_bitlength(ab,lex);
-    double posteriors = 0;
-    parse* res_parse = parse_create();
-   
-    char32_t join_buffer[JOIN_BUFFER_SZ];
-    for(size_t i=0;i<corpus_sz;i++)
-    {
-        minseg* mseg = minseg_create(lex,corpus[i]);
-        posteriors += mseg->cost;
-        for(size_t j=0;j<mseg->size;j+=2)
-        { 
-            if(j+1 == mseg->size)
-                parse_add(res_parse,mseg->segments[j]);      
-            else
-            {
-                u32strjoin(join_buffer,mseg->segments[j],mseg->segments[j+1]);
-                parse_add(res_parse,join_buffer);
-            } 
-        }
-        minseg_free(mseg);
-    }
+    st->index = minseg_index_create(lex);
+    state_track_index(st);
+    double priors = st->key_costs;
+    double posteriors = state_pass(st,wk,corpus,true);
     
     res->lexicons[0] = lex;
     res->priors[0] = priors;
     res->posteriors[0] = posteriors;
 
 
-    return res_parse;
+    return state_candidates(st);
 }
 
-static lexicon* 
-lexicon_copy(lexicon* origin)
+// The state index holds the trie of every word seen so far, counted
+// for the previous lexicon. It is extended with the new words for the
+// first segmentation and then recounted from lexicon_n for the second
+// one.
+static lexicon*
+iteration_n(size_t it_n,uint8_t n_new_words, alphabet*ab, workers* wk, const lexhnd_corpus* corpus, 
+        lexhnd_result* res, lexicon* candidate_new_words, state* st)
 {
-    lexicon* copy = lexicon_create();
-    for(size_t i=0;i<origin->capacity;i++)
-    {
-        if(origin->table[i] != NULL)
-        {
-            lexicon_add(copy,origin->table[i]->key, origin->table[i]->count);
-        }
-    }
-    return copy;
-}
-
-static parse*
-iteration_n(size_t it_n,uint8_t n_new_words, alphabet*ab, char32_t**corpus, size_t corpus_sz, 
-        lexhnd_result* res, parse* old_parse)
-{
-    
-    lexicon* candidate_new_words = lexicon_create(); 
-
-    // Populate candidate lexicon with joint items from old parse
-    while(old_parse->pos) lexicon_add(candidate_new_words,parse_pop(old_parse),1);
-    litem** litems = malloc(candidate_new_words->occupancy * sizeof(litem*));
-    lexicon_get_items(candidate_new_words, litems);
+    minseg_index* index = st->index;
+    litem* litems[UINT8_MAX];
+    size_t n_top = lexicon_top_items(candidate_new_words,litems,n_new_words);
 
-    // Create temporary lexicon with old lexicon + n most frequent 
+    // Extend the index of the old lexicon with the n most frequent 
     // new joint items
-    lexicon* temp = lexicon_copy(res->lexicons[it_n-1]);
-    for(size_t i=0;i<n_new_words;i++)
+    for(size_t i=0;i<n_top;i++)
     {
-        lexicon_add(temp,litems[i]->key,litems[i]->count);
+        state_add_word(st,u32view_make(litems[i]->key,litems[i]->length),litems[i]->count);
     }
+    minseg_index_score(index);
 
  
-    // Minseg 1 
-    parse* first_parse = parse_create();
-    for(size_t i=0;i<corpus_sz;i++)
-    {
-        minseg* m1 = minseg_create(temp,corpus[i]);
-        for(size_t j=0;j<m1->size;j++)
-            parse_add(first_parse,m1->segments[j]);
-        minseg_free(m1);
-    }
-    
-    // Lexicon
+    // Minseg 1 and lexicon
+    state_pass(st,wk,corpus,false);
+    token_counts* words = workers_count(wk,corpus);
     lexicon* lexicon_n = lexicon_create();
-    while(first_parse->pos) lexicon_add(lexicon_n,parse_pop(first_parse),1);
+    lexicon_reserve(lexicon_n,words->occupancy);
+    token_counts_to_lexicon(words,index,ab,lexicon_n);
     
 
     // Minseg 2
-    parse* second_parse = parse_create();
-    double priors = get_lexicon_bitlength(ab,lexicon_n);
-    double posteriors = 0;
-    char32_t join_buffer[JOIN_BUFFER_SZ];
-    for(size_t i=0;i<corpus_sz;i++)
-    {
-        minseg* m2 = minseg_create(lexicon_n,corpus[i]);
-        posteriors += m2->cost;
-        for(size_t j=0;j<m2->size;j+=2)
-        { 
-            if(j+1 == m2->size)
-                parse_add(second_parse,m2->segments[j]);      
-            else
-            {
-                u32strjoin(join_buffer,m2->segments[j],m2->segments[j+1]);
-                parse_add(second_parse,join_buffer);
-            } 
-        }
-        minseg_free(m2);
-    }
+    state_recount(st,words);
+    token_counts_free(words);
+    double priors = st->key_costs;
+    double posteriors = state_pass(st,wk,corpus,true);
 
     res->lexicons[it_n] = lexicon_n;
     res->posteriors[it_n] = posteriors;
     res->priors[it_n] = priors;
 
-
-    parse_free(first_parse); 
-    lexicon_free(candidate_new_words); 
-    lexicon_free(temp);
-    free(litems);
-
-    return second_parse;
+    return state_candidates(st);
 
 }
 
@@ -396,7 +1128,52 @@ lexhnd_run(
         uint8_t n_new_words
         )
 {
-    lexhnd_result* result = malloc(sizeof(lexhnd_result*));
+    lexhnd_options options;
+    options.n_iterations = n_iterations;
+    options.n_new_words = n_new_words;
+    options.n_threads = 0;
+    return lexhnd_run_with(corpus,corpus_size,&options);
+}
+
+lexhnd_result* 
+lexhnd_run_with(
+        char32_t** corpus,
+        size_t corpus_size,
+        const lexhnd_options* options
+        )
+{
+    lexhnd_corpus* packed = lexhnd_corpus_create();
+    for(size_t i=0;i<corpus_size;i++) lexhnd_corpus_add(packed,u32view_from(corpus[i]));
+    lexhnd_result* result = lexhnd_run_corpus(packed,options);
+    lexhnd_corpus_free(packed);
+    return result;
+}
+
+lexhnd_result* 
+lexhnd_run_types(
+        lexicon* types,
+        const lexhnd_options* options
+        )
+{
+    lexhnd_corpus* packed = lexhnd_corpus_create();
+    size_t cursor = 0;
+    litem* item;
+    while((item = lexicon_next_item(types,&cursor)) != NULL)
+        lexhnd_corpus_add_weighted(packed,u32view_make(item->key,item->length),item->count);
+    lexhnd_result* result = lexhnd_run_corpus(packed,options);
+    lexhnd_corpus_free(packed);
+    return result;
+}
+
+lexhnd_result* 
+lexhnd_run_corpus(
+        lexhnd_corpus* corpus,
+        const lexhnd_options* options
+        )
+{
+    uint8_t n_iterations = options->n_iterations;
+    size_t corpus_size = corpus->n_words;
+    lexhnd_result* result = malloc(sizeof(lexhnd_result));
     if(result == NULL) abort();
     
     result->lexicons = malloc(n_iterations * sizeof(lexicon*));
@@ -406,21 +1183,24 @@ lexhnd_run(
        result->priors == NULL ||
        result->posteriors == NULL) abort();
 
-    alphabet* ab = alphabet_create();
-    alphabet_setup(ab,corpus,corpus_size);
+    alphabet* ab = corpus->ab;
+    alphabet_score(ab);
+    workers* wk = workers_create(options->n_threads,corpus_size);
     
 
-    parse* prs = iteration_zero(ab,corpus,corpus_size,result);
+    state* st = state_create(corpus);
+    lexicon* candidates = iteration_zero(ab,wk,corpus,result,st);
     
     for(size_t i=1;i<n_iterations;i++)
     {
-        prs = iteration_n(i,n_new_words,ab,corpus,corpus_size,result,prs);
+        lexicon* old_candidates = candidates;
+        candidates = iteration_n(i,options->n_new_words,ab,wk,corpus,result,old_candidates,st);
+        lexicon_free(old_candidates);
     }
     
-    parse_free(prs);
-    alphabet_free(ab);
+    state_free(st);
+    lexicon_free(candidates);
+    workers_free(wk);
 
     return result;
 }
-
-
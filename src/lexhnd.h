@@ -13,6 +13,42 @@ typedef struct lexhnd_result
     double* posteriors;
 } lexhnd_result;
 
+typedef struct lexhnd_options
+{
+    uint8_t n_iterations;
+    uint8_t n_new_words;
+    // Worker threads for the segmentation passes, 0 uses one per
+    // online processor
+    size_t n_threads;
+} lexhnd_options;
+
+// Corpus packed as symbol IDs of one or two bytes when the alphabet
+// allows, with the words back to back in a single buffer. It also
+// holds the character counts of the words added to it.
+typedef struct lexhnd_corpus lexhnd_corpus;
+
+lexhnd_corpus*
+lexhnd_corpus_create();
+
+void
+lexhnd_corpus_add(lexhnd_corpus* corpus, u32view word);
+
+// Adds a word standing for count occurrences of it. The word is
+// segmented once and its costs and segments are counted count times.
+void
+lexhnd_corpus_add_weighted(lexhnd_corpus* corpus, u32view word, uint64_t count);
+
+// Number of words
+size_t
+lexhnd_corpus_size(const lexhnd_corpus* corpus);
+
+// Memory taken by the symbols and word offsets
+size_t
+lexhnd_corpus_bytes(const lexhnd_corpus* corpus);
+
+void
+lexhnd_corpus_free(lexhnd_corpus* corpus);
+
 lexhnd_result* 
 lexhnd_run(
         char32_t** corpus, 
@@ -21,4 +57,25 @@ lexhnd_run(
         uint8_t n_new_words
         ); 
 
+lexhnd_result* 
+lexhnd_run_with(
+        char32_t** corpus, 
+        size_t corpus_size, 
+        const lexhnd_options* options
+        ); 
+
+// Runs on the distinct words of a corpus, as counted by the entries
+// of types (e.g. from lexicon_populate_from_wordlist_file)
+lexhnd_result* 
+lexhnd_run_types(
+        lexicon* types, 
+        const lexhnd_options* options
+        ); 
+
+lexhnd_result* 
+lexhnd_run_corpus(
+        lexhnd_corpus* corpus, 
+        const lexhnd_options* options
+        ); 
+
 #endif
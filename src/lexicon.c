@@ -1,28 +1,55 @@
+// madvise is not part of C11
+#define _DEFAULT_SOURCE
 #include <stdint.h>
 #include <uchar.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <float.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "cu32.h"
 #include "lexicon.h"
 
-#define HASH_MAGIC_NUMBER 5381
-
-static size_t 
-hash(const char32_t* key)
+static inline size_t 
+hash(u32view word)
 {
-    unsigned long int hsh = HASH_MAGIC_NUMBER;
-    unsigned int c;
-    while((c = *key++))
-    {
-        hsh = ((hsh << 5) * hsh) + c;
-    }
-    return (size_t) hsh;
+    return (size_t) u32view_hash(word);
 } 
 
+#define CTRL_EMPTY 0x80
+#define CTRL_GROUP 16
+
+static uint8_t*
+ctrl_create(size_t capacity)
+{
+    // The first group is mirrored after the end, so a group starting
+    // anywhere can be loaded without wrapping
+    uint8_t* ctrl = malloc(capacity + CTRL_GROUP);
+    if(ctrl == NULL) abort();
+    memset(ctrl, CTRL_EMPTY, capacity + CTRL_GROUP);
+    return ctrl;
+}
+
 lexicon* 
 lexicon_create()
+{
+    return lexicon_create_backend(LEXICON_BACKEND_LINEAR);
+}
+
+lexicon* 
+lexicon_create_backend(uint8_t backend)
 {
     lexicon* lex = malloc(sizeof(lexicon));
     if(lex == NULL) goto exit1;
@@ -30,10 +57,15 @@ lexicon_create()
     lex->capacity = LEXICON_INITIAL_CAPACITY; 
     lex->occupancy = 0;
     lex->total_counts = 0;
-    lex->table = malloc(sizeof(litem*) * LEXICON_INITIAL_CAPACITY);
+    lex->version = 0;
+    lex->max_key_length = 0;
+    lex->scored = false;
+    lex->arena = NULL;
+    lex->table = calloc(LEXICON_INITIAL_CAPACITY, sizeof(litem));
     if(lex->table == NULL) goto exit2; 
+    lex->backend = backend;
+    lex->ctrl = backend == LEXICON_BACKEND_SWISS ? ctrl_create(lex->capacity) : NULL;
 
-    for(int i=0;i<lex->capacity;i++) lex->table[i] = NULL;
     return lex;
 
     
@@ -47,119 +79,249 @@ exit1:
 void 
 lexicon_free(lexicon* lexicon)
 {
-    for(int i=0; i<lexicon->capacity; i++)
+    while(lexicon->arena != NULL)
     {
-        if(lexicon->table[i] == NULL) continue;
-        free(lexicon->table[i]->key); lexicon->table[i]->key = NULL;
-        free(lexicon->table[i]); lexicon->table[i] = NULL;
+        lexicon_block* next = lexicon->arena->next;
+        free(lexicon->arena);
+        lexicon->arena = next;
     }
+    free(lexicon->table);
+    free(lexicon->ctrl);
     free(lexicon);
 }
 
-static int8_t
-u32strcmp(const char32_t* str1, const char32_t* str2)
+// Copies a key into the arena. Blocks are never moved, so keys stay
+// valid for the lifetime of the lexicon.
+static char32_t*
+arena_store(lexicon* lexicon, u32view word)
 {
-
-    size_t len = u32strlen(str1);
-    if(len != u32strlen(str2)) return -1;
-    for(size_t i=0;i<len;i++)
+    size_t len = word.len;
+    lexicon_block* block = lexicon->arena;
+    if(block == NULL || block->size - block->used < len + 1)
     {
-        if(str1[i] != str2[i]) return -1;
+        size_t size = block == NULL ? LEXICON_ARENA_BLOCK_SIZE : 2 * block->size;
+        if(size < len + 1) size = len + 1;
+        lexicon_block* new_block = malloc(sizeof(lexicon_block) + size * sizeof(char32_t));
+        if(new_block == NULL) abort();
+        new_block->next = block;
+        new_block->size = size;
+        new_block->used = 0;
+        lexicon->arena = new_block;
+        block = new_block;
     }
-    return 0;
+
+    char32_t* key = block->keys + block->used;
+    u32view_copy(key, word);
+    block->used += len + 1;
+    return key;
+}
+
+static inline bool
+item_matches(const litem* item, size_t hsh, u32view word)
+{
+    return item->hash == hsh && item->length == word.len && 
+        memcmp(item->key, word.str, word.len * sizeof(char32_t)) == 0;
 }
 
 uint64_t 
 lexicon_get_count(lexicon* lexicon, const char32_t* word)
 {
-    size_t hsh = hash(word) % lexicon->capacity;
-    if(lexicon->table[hsh] == NULL) return 0;
-    size_t i = hsh;
-    while(1)
-    {
-        if(u32strcmp(word, lexicon->table[i]->key) == 0) 
-            return lexicon->table[i]->count;
-        i++;
+    return lexicon_get_count_view(lexicon, u32view_from(word));
+}
 
-        if(i==hsh) break;
-        if(i >= lexicon->capacity) i = 0;
-        if(lexicon->table[i] == NULL) break;
+// Returns the slot holding word or, if absent, the empty slot where it
+// would be inserted. The load factor guarantees an empty slot ends
+// every probe.
+static size_t
+linear_probe(lexicon* lexicon, size_t hsh, u32view word)
+{
+    size_t mask = lexicon->capacity - 1;
+    size_t i = hsh & mask;
+    while(lexicon->table[i].key != NULL)
+    {
+        if(item_matches(&lexicon->table[i], hsh, word)) return i;
+        i = (i + 1) & mask;
     }    
-    return 0;
+    return i;
 }
 
+// Control bytes of the swiss backend hold CTRL_EMPTY or the top seven
+// bits of the hash of the entry in the slot
+static inline uint8_t
+ctrl_fragment(size_t hsh)
+{
+    return (uint8_t) ((uint64_t) hsh >> 57);
+}
 
-static void 
-create_item(const char32_t* word, size_t count, litem* item)
+static inline uint32_t
+group_match(const uint8_t* group, uint8_t byte)
 {
-    item->key = calloc((u32strlen(word) + 1), sizeof(char32_t) );
-    if(item->key == NULL) abort();
-    u32strcpy(item->key, word);
-    item->count = count;
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i*) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) byte)));
+#else
+    uint32_t bits = 0;
+    for(int i=0;i<CTRL_GROUP;i++) if(group[i] == byte) bits |= 1u << i;
+    return bits;
+#endif
 }
 
-static void
-add_item(litem** items, size_t* occupancy, size_t capacity, const char32_t* word, size_t count)
+static inline void
+ctrl_set(uint8_t* ctrl, size_t capacity, size_t slot, uint8_t byte)
 {
-    size_t hsh = hash(word) % capacity;
-    size_t slot = hsh;
+    ctrl[slot] = byte;
+    if(slot < CTRL_GROUP) ctrl[capacity + slot] = byte;
+}
 
+// Same contract as linear_probe. Sixteen control bytes are compared
+// at once, so most misses end without reading any slot.
+static size_t
+swiss_probe(lexicon* lexicon, size_t hsh, u32view word)
+{
+    size_t mask = lexicon->capacity - 1;
+    uint8_t fragment = ctrl_fragment(hsh);
+    size_t pos = hsh & mask;
     while(1)
     {
-        if(slot >= capacity) slot = 0;
-
-        if(items[slot] == NULL) 
+        const uint8_t* group = lexicon->ctrl + pos;
+        uint32_t matches = group_match(group, fragment);
+        while(matches)
         {
-            litem* item = malloc(sizeof(litem));
-            if(item == NULL) abort();
-            create_item(word,count, item);
-            items[slot] = item;
-            *occupancy += 1;
-            return;
+            size_t slot = (pos + __builtin_ctz(matches)) & mask;
+            if(item_matches(&lexicon->table[slot], hsh, word)) return slot;
+            matches &= matches - 1;
         }
+        uint32_t empty = group_match(group, CTRL_EMPTY);
+        if(empty) return (pos + __builtin_ctz(empty)) & mask;
+        pos = (pos + CTRL_GROUP) & mask;
+    }
+}
 
-        if(u32strcmp(items[slot]->key, word) == 0)
-        {
-            items[slot]->count += count;         
-            return;
-        }
-        slot++;
-        if(slot == hsh) return;
-    }   
+static inline size_t
+probe(lexicon* lexicon, size_t hsh, u32view word)
+{
+    if(lexicon->backend == LEXICON_BACKEND_SWISS) return swiss_probe(lexicon, hsh, word);
+    return linear_probe(lexicon, hsh, word);
+}
+
+static litem*
+find_item(lexicon* lexicon, u32view word)
+{
+    size_t slot = probe(lexicon, hash(word), word);
+    return lexicon->table[slot].key == NULL ? NULL : &lexicon->table[slot];
+}
+
+uint64_t 
+lexicon_get_count_view(lexicon* lexicon, u32view word)
+{
+    litem* item = find_item(lexicon, word);
+    return item == NULL ? 0 : item->count;
+}
+
+static double
+item_cost(uint64_t count, uint64_t total_counts)
+{
+    if(count == 0) return DBL_MAX;
+    double prob = (double) count/total_counts;
+    return -1 * log2(prob);
+}
+
+void
+lexicon_score(lexicon* lexicon)
+{
+    for(size_t i=0;i<lexicon->capacity;i++)
+    {
+        if(lexicon->table[i].key == NULL) continue;
+        lexicon->table[i].cost = item_cost(lexicon->table[i].count, lexicon->total_counts);
+    }
+    lexicon->scored = true;
+}
+
+double
+lexicon_get_cost_view(lexicon* lexicon, u32view word)
+{
+    return lexicon_get_cost_hashed(lexicon, word, hash(word));
+}
+
+size_t
+lexicon_prefetch_view(lexicon* lexicon, u32view word)
+{
+    size_t hsh = hash(word);
+    size_t slot = hsh & (lexicon->capacity - 1);
+    if(lexicon->backend == LEXICON_BACKEND_SWISS) __builtin_prefetch(lexicon->ctrl + slot);
+    __builtin_prefetch(&lexicon->table[slot]);
+    return hsh;
+}
+
+double
+lexicon_get_cost_hashed(lexicon* lexicon, u32view word, size_t hsh)
+{
+    litem* item = &lexicon->table[probe(lexicon, hsh, word)];
+    if(item->key == NULL) return DBL_MAX;
+    if(lexicon->scored) return item->cost;
+    return item_cost(item->count, lexicon->total_counts);
+}
+
+
+static void
+add_item(lexicon* lexicon, u32view word, size_t count)
+{
+    size_t hsh = hash(word);
+    size_t slot = probe(lexicon, hsh, word);
+    litem* item = &lexicon->table[slot];
+
+    if(item->key != NULL) 
+    {
+        item->count += count;         
+        return;
+    }
+
+    item->key = arena_store(lexicon, word);
+    item->count = count;
+    item->hash = hsh;
+    item->length = word.len;
+    if(lexicon->ctrl != NULL) 
+        ctrl_set(lexicon->ctrl, lexicon->capacity, slot, ctrl_fragment(hsh));
+    lexicon->occupancy += 1;
 }
 
 static void 
-rehash(lexicon* lexicon)
+rehash(lexicon* lexicon, size_t new_capacity)
 {
-    size_t new_capacity = 2*lexicon->capacity;
-    litem** new_list = (litem**) malloc(new_capacity * sizeof(litem*));
+    size_t mask = new_capacity - 1;
+    litem* new_list = calloc(new_capacity, sizeof(litem));
     if(new_list == NULL) abort();
+    uint8_t* new_ctrl = lexicon->ctrl == NULL ? NULL : ctrl_create(new_capacity);
 
-    for(size_t i=0;i<new_capacity;i++) new_list[i] = NULL;
-
-    // Copy existing items into new list
+    // Move existing items into new list, placed by their stored hash.
+    // Keys are distinct, so each one goes to the first empty slot its
+    // probe sequence meets.
     for(size_t i=0;i<lexicon->capacity;i++)
     {
-        if(lexicon->table[i] == NULL) continue;
+        if(lexicon->table[i].key == NULL) continue;
+        size_t hsh = lexicon->table[i].hash;
+        size_t slot = hsh & mask;
 
-        size_t slot = hash(lexicon->table[i]->key) % new_capacity;
-        while(1)
+        if(new_ctrl == NULL)
+        {
+            while(new_list[slot].key != NULL) slot = (slot + 1) & mask;
+        }
+        else
         {
-            if(new_list[slot] == NULL) 
-            {
-                new_list[slot] = lexicon->table[i];
-                lexicon->table[i] = NULL;
-                break;
-            }
-
-            slot++;
-            if(slot >= new_capacity) slot = 0;          
+            uint32_t empty;
+            while(!(empty = group_match(new_ctrl + slot, CTRL_EMPTY))) 
+                slot = (slot + CTRL_GROUP) & mask;
+            slot = (slot + __builtin_ctz(empty)) & mask;
+            ctrl_set(new_ctrl, new_capacity, slot, ctrl_fragment(hsh));
         }
+        new_list[slot] = lexicon->table[i];
     }
 
     // Replace table
     free(lexicon->table);
+    free(lexicon->ctrl);
     lexicon->table = new_list;
+    lexicon->ctrl = new_ctrl;
     lexicon->capacity = new_capacity;
 }
 
@@ -168,44 +330,198 @@ rehash(lexicon* lexicon)
 void 
 lexicon_add(lexicon* lexicon, const char32_t* word, size_t count)
 { 
-    add_item(lexicon->table,&lexicon->occupancy,lexicon->capacity,word, count);
+    lexicon_add_view(lexicon, u32view_from(word), count);
+}
+
+void 
+lexicon_add_view(lexicon* lexicon, u32view word, size_t count)
+{ 
+    add_item(lexicon,word,count);
+    lexicon->scored = false;
+    lexicon->version++;
+
+    if(word.len > lexicon->max_key_length) lexicon->max_key_length = word.len;
    
     lexicon->total_counts += count;
     if((float) lexicon->occupancy/lexicon->capacity >= LEXICON_LOAD_FACTOR) 
     {
-       rehash(lexicon);
+       rehash(lexicon, 2*lexicon->capacity);
+    }
+}
+
+void
+lexicon_reserve(lexicon* lexicon, size_t n_entries)
+{
+    size_t new_capacity = lexicon->capacity;
+    while((float) n_entries/new_capacity >= LEXICON_LOAD_FACTOR) new_capacity *= 2;
+    if(new_capacity > lexicon->capacity) rehash(lexicon, new_capacity);
+}
+
+
+// Rehashes into the smallest table that holds the entries under the
+// load factor, never below min_capacity
+static void
+shrink_to_fit(lexicon* lexicon, size_t min_capacity)
+{
+    size_t new_capacity = min_capacity;
+    while((float) lexicon->occupancy/new_capacity >= LEXICON_LOAD_FACTOR) new_capacity *= 2;
+    if(new_capacity < lexicon->capacity) rehash(lexicon, new_capacity);
+}
+
+uint64_t
+lexicon_probe_histogram(lexicon* lexicon, uint64_t* histogram, size_t n_bins)
+{
+    uint64_t total_distance = 0;
+    for(size_t i=0;i<n_bins;i++) histogram[i] = 0;
+    for(size_t i=0;i<lexicon->capacity;i++)
+    {
+        if(lexicon->table[i].key == NULL) continue;
+        size_t home = lexicon->table[i].hash & (lexicon->capacity - 1);
+        size_t distance = (i - home) & (lexicon->capacity - 1);
+        total_distance += distance;
+        if(distance >= n_bins) distance = n_bins - 1;
+        histogram[distance]++;
+    }
+    return total_distance;
+}
+
+typedef struct mapped_file
+{
+    const char* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} mapped_file;
+
+// Maps the whole file read only. Returns false if it cannot be opened
+// or is empty.
+static bool
+map_file(const char* filename, mapped_file* map)
+{
+#ifdef _WIN32
+    map->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(map->file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(map->file, &size) || size.QuadPart == 0) goto fail_file;
+    map->size = (size_t) size.QuadPart;
+    map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(map->mapping == NULL) goto fail_file;
+    map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    if(map->data == NULL) goto fail_mapping;
+    return true;
+
+fail_mapping:
+    CloseHandle(map->mapping);
+fail_file:
+    CloseHandle(map->file);
+    return false;
+#else
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) 
+    {
+        close(fd);
+        return false;
     }
+    map->size = (size_t) st.st_size;
+    void* data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return false;
+#ifdef MADV_SEQUENTIAL
+    madvise(data, map->size, MADV_SEQUENTIAL);
+#endif
+    map->data = data;
+    return true;
+#endif
 }
 
+static void
+unmap_file(mapped_file* map)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#else
+    munmap((void*) map->data, map->size);
+#endif
+}
 
 void
 lexicon_populate_from_wordlist_file(lexicon* lexicon, const char* filename)
 {
-    FILE *fptr = fopen(filename,"r");
-    if(fptr == NULL) return;
+    mapped_file map;
+    if(!map_file(filename, &map)) return;
+    const char* end = map.data + map.size;
 
-    char buffer[80];
-    while(fgets(buffer,80,fptr))
+    size_t n_lines = 0;
+    const char* pos = map.data;
+    while((pos = memchr(pos, '\n', end - pos)) != NULL)
     {
+        n_lines++;
+        pos++;
+    }
+    if(end[-1] != '\n') n_lines++;
+
+    // Lines are decoded into one scratch buffer, grown to the longest
+    // line; lexicon_add_view copies new keys into the arena
+    size_t buffer_sz = 128;
+    char32_t* buffer = malloc(buffer_sz * sizeof(char32_t));
+    if(buffer == NULL) abort();
+
+    // No list has more new keys than lines, so reserving for every
+    // line means no rehash during the load. Lines repeat, so the table
+    // is then shrunk to fit, but not below what the caller reserved.
+    size_t capacity_before = lexicon->capacity;
+    lexicon_reserve(lexicon, lexicon->occupancy + n_lines);
+    const char* line = map.data;
+    while(line < end)
+    {
+        const char* line_end = memchr(line, '\n', end - line);
+        if(line_end == NULL) line_end = end;
+        size_t bytelen = line_end - line;
+        if(bytelen && line[bytelen-1] == '\r') bytelen--;
 
-        buffer[strcspn(buffer,"\n")] = 0;
-        char32_t* word = malloc((u8strlen(buffer) + 1) * sizeof(char32_t));
-        if(word == NULL) abort(); 
+        if(bytelen + 1 > buffer_sz)
+        {
+            while(bytelen + 1 > buffer_sz) buffer_sz *= 2;
+            free(buffer);
+            buffer = malloc(buffer_sz * sizeof(char32_t));
+            if(buffer == NULL) abort();
+        }
 
-        u8to32(buffer,word);
-        lexicon_add(lexicon,word,1);
-        free(word);
+        size_t len = u8to32_n(line, bytelen, buffer);
+        lexicon_add_view(lexicon, u32view_make(buffer, len), 1);
+        line = line_end + 1;
     }
-    fclose(fptr);
+
+    free(buffer);
+    unmap_file(&map);
+    shrink_to_fit(lexicon, capacity_before);
+    lexicon_score(lexicon);
 }
 
+// Orders by decreasing count. Ties are broken by key so that the
+// order does not depend on where entries landed in the table.
 static
 int compare_item_freqs(const void* item_a, const void* item_b)
 {
-    uint64_t a = (*((litem**) item_a))->count;
-    uint64_t b = (*((litem**) item_b))->count;
+    const litem* ia = *((litem**) item_a);
+    const litem* ib = *((litem**) item_b);
+    uint64_t a = ia->count;
+    uint64_t b = ib->count;
 
-    return (a < b) - (a > b);
+    if(a != b) return (a < b) - (a > b);
+    size_t len = ia->length < ib->length ? ia->length : ib->length;
+    for(size_t i=0;i<len;i++)
+    {
+        if(ia->key[i] != ib->key[i]) return (ia->key[i] > ib->key[i]) - (ia->key[i] < ib->key[i]);
+    }
+    return (ia->length > ib->length) - (ia->length < ib->length);
 }
 
 void 
@@ -215,9 +531,9 @@ lexicon_get_items(lexicon* lexicon, litem** lex_items)
     size_t li = 0;
     for(size_t i=0;i<lexicon->capacity;i++)
     {
-        if(lexicon->table[i] != NULL)
+        if(lexicon->table[i].key != NULL)
         {   
-            lex_items[li] = lexicon->table[i];
+            lex_items[li] = &lexicon->table[i];
             li++;
         }
     }
@@ -225,3 +541,78 @@ lexicon_get_items(lexicon* lexicon, litem** lex_items)
     // sort
     qsort(lex_items,lexicon->occupancy,sizeof(litem*),compare_item_freqs);
 }
+
+litem*
+lexicon_next_item(lexicon* lexicon, size_t* cursor)
+{
+    while(*cursor < lexicon->capacity)
+    {
+        litem* item = &lexicon->table[(*cursor)++];
+        if(item->key != NULL) return item;
+    }
+    return NULL;
+}
+
+// Moves the root of a heap of n items down to its place. The root is
+// the item that ranks last, so it is the first one to be replaced.
+static void
+heap_sift_down(litem** heap, size_t n)
+{
+    size_t i = 0;
+    while(1)
+    {
+        size_t worst = i;
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
+        if(l < n && compare_item_freqs(&heap[l],&heap[worst]) > 0) worst = l;
+        if(r < n && compare_item_freqs(&heap[r],&heap[worst]) > 0) worst = r;
+        if(worst == i) return;
+        litem* tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+static void
+heap_sift_up(litem** heap, size_t i)
+{
+    while(i)
+    {
+        size_t parent = (i - 1) / 2;
+        if(compare_item_freqs(&heap[i],&heap[parent]) <= 0) return;
+        litem* tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+size_t
+lexicon_top_items(lexicon* lexicon, litem** top_items, size_t k)
+{
+    if(k == 0) return 0;
+
+    // keep the k best items seen so far in a heap topped by the worst
+    size_t n = 0;
+    size_t cursor = 0;
+    litem* item;
+    while((item = lexicon_next_item(lexicon,&cursor)) != NULL)
+    {
+        if(n < k)
+        {
+            top_items[n] = item;
+            heap_sift_up(top_items,n);
+            n++;
+        }
+        else if(compare_item_freqs(&item,&top_items[0]) < 0)
+        {
+            top_items[0] = item;
+            heap_sift_down(top_items,n);
+        }
+    }
+
+    // sort
+    qsort(top_items,n,sizeof(litem*),compare_item_freqs);
+    return n;
+}
@@ -11,40 +11,139 @@
 #define __LEXICON_H__
 
 #include <uchar.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "cu32.h"
 
-#define LEXICON_INITIAL_CAPACITY 8000
+// Capacity is kept a power of two so slots are found by masking
+#define LEXICON_INITIAL_CAPACITY 8192
 #define LEXICON_LOAD_FACTOR 0.70
+#define LEXICON_ARENA_BLOCK_SIZE 16384
 
+// Probing strategies. LINEAR visits slots one by one; SWISS keeps a
+// control byte per slot with a hash fragment and scans them sixteen at
+// a time (with SSE2 when available).
+#define LEXICON_BACKEND_LINEAR 0
+#define LEXICON_BACKEND_SWISS 1
+
+// A slot of the table. Empty slots have a NULL key; keys live in the
+// lexicon arena and are NUL terminated. The hash and length are
+// compared before the key is touched.
 typedef struct litem
 {
     char32_t* key;
     size_t count;
+    // Code length -log2(count/total_counts), valid while the lexicon
+    // is scored
+    double cost;
+    size_t hash;
+    size_t length;
 } litem;
 
+// Block of the key arena. Blocks are chained from the newest and
+// released all at once by lexicon_free.
+typedef struct lexicon_block
+{
+    struct lexicon_block* next;
+    size_t size;
+    size_t used;
+    char32_t keys[];
+} lexicon_block;
+
 typedef struct lexicon 
 {
-    struct litem** table;   
+    struct litem* table;   
+    struct lexicon_block* arena;
     uint64_t total_counts;
     uint64_t capacity;
     uint64_t occupancy;
+    // Bumped by every lexicon_add, so results derived from the lexicon
+    // can tell they are stale
+    uint64_t version;
+    size_t max_key_length;
+    bool scored;
+    uint8_t backend;
+    uint8_t* ctrl;
 } lexicon;
 
 lexicon* 
 lexicon_create();
 
+lexicon* 
+lexicon_create_backend(uint8_t backend);
+
 void 
 lexicon_free(lexicon* lexicon);
 
 void 
 lexicon_add(lexicon* lexicon, const char32_t* word, size_t count);
 
+void 
+lexicon_add_view(lexicon* lexicon, u32view word, size_t count);
+
+// Counts how many entries sit at each distance from their home slot;
+// the last bin also collects every longer probe. Returns the sum of
+// all distances.
+uint64_t
+lexicon_probe_histogram(lexicon* lexicon, uint64_t* histogram, size_t n_bins);
+
+// Grows the table so that n_entries fit without a rehash
+void
+lexicon_reserve(lexicon* lexicon, size_t n_entries);
+
+// Adds one count for each line of a UTF8 file. The file is memory
+// mapped and the table reserved for one new key per line, so it never
+// rehashes during the load, then fitted to the entries. A capacity set
+// with lexicon_reserve beforehand is kept. The lexicon is left scored.
 void 
 lexicon_populate_from_wordlist_file(lexicon* lexicon, const char* filename);
 
+// Fills lex_items with every entry sorted by decreasing count. The
+// array must hold lexicon->occupancy pointers.
+// The items returned here and by lexicon_top_items and
+// lexicon_next_item are slots of the table, not copies: they reflect
+// later count changes and dangle once a lexicon_add grows the table.
+// Their keys live in the arena and stay valid until lexicon_free.
 void 
 lexicon_get_items(lexicon* lexicon, litem** lex_items);
 
+// Fills top_items with the k entries of highest count, in the order
+// lexicon_get_items would give them, without sorting the whole table.
+// Returns how many were written, which is less than k only when the
+// lexicon holds fewer entries.
+size_t
+lexicon_top_items(lexicon* lexicon, litem** top_items, size_t k);
+
+// Walks the entries in table order. Start with *cursor = 0; returns
+// NULL once every entry has been visited. Adding to the lexicon
+// during the walk invalidates the cursor.
+litem*
+lexicon_next_item(lexicon* lexicon, size_t* cursor);
+
 uint64_t 
 lexicon_get_count(lexicon* lexicon, const char32_t* word);
 
+uint64_t 
+lexicon_get_count_view(lexicon* lexicon, u32view word);
+
+// Freezes the code length of every entry into its item. Any later
+// lexicon_add invalidates the snapshot.
+void
+lexicon_score(lexicon* lexicon);
+
+// Code length of word, DBL_MAX if absent. Reads the cached cost when
+// the lexicon is scored.
+double
+lexicon_get_cost_view(lexicon* lexicon, u32view word);
+
+// Lookup split in two for callers that keep many probes in flight:
+// lexicon_prefetch_view hashes word and starts loading the memory its
+// probe reads first, and lexicon_get_cost_hashed finishes the lookup
+// with that hash once the loads had time to land
+size_t
+lexicon_prefetch_view(lexicon* lexicon, u32view word);
+
+double
+lexicon_get_cost_hashed(lexicon* lexicon, u32view word, size_t hsh);
+
 #endif
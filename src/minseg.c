@@ -2,136 +2,1245 @@
 #include <string.h>
 #include <float.h>
 #include <math.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include "cu32.h"
 #include "lexicon.h"
 #include "minseg.h"
 
 
-static double 
-lexicon_lookup(lexicon* lex, const char32_t* word)
+minseg_workspace*
+minseg_workspace_create()
 {
-    size_t count = lexicon_get_count(lex, word); 
-    if(count == 0) return DBL_MAX;
-    double prob = (double) count/lex->total_counts;
+    minseg_workspace* ws = calloc(1, sizeof(minseg_workspace));
+    if(ws == NULL) abort();
+    return ws;
+}
+
+void
+minseg_workspace_free(minseg_workspace* ws)
+{
+    free(ws->costs);
+    free(ws->starts);
+    free(ws->entries);
+    free(ws->probe_words);
+    free(ws->probe_hashes);
+    free(ws->probe_costs);
+    free(ws);
+}
+
+// Makes room for a sentence of length characters
+static void
+workspace_reserve(minseg_workspace* ws, size_t length)
+{
+    if(length + 1 <= ws->positions_capacity) return;
+    size_t capacity = ws->positions_capacity ? ws->positions_capacity : MINSEG_WORKSPACE_INITIAL_POSITIONS;
+    while(capacity < length + 1) capacity *= 2;
+    ws->costs = realloc(ws->costs, capacity * sizeof(double));
+    ws->starts = realloc(ws->starts, capacity * sizeof(size_t));
+    ws->entries = realloc(ws->entries, capacity * sizeof(uint32_t));
+    if(ws->costs == NULL || ws->starts == NULL || ws->entries == NULL) abort();
+    ws->positions_capacity = capacity;
+}
+
+// Code length charged for a character no word reaches, which becomes
+// a segment of its own: about that of a word seen once. Being finite,
+// it lets the words after the character still be found.
+static inline double
+unknown_cost(uint64_t total_counts)
+{
+    return log2((double) total_counts + 1);
+}
+
+// First start probed for words ending at boundary end: no key is
+// longer than max_length, so earlier starts would only probe for words
+// that cannot be in the lexicon
+static inline size_t
+first_start(size_t end, size_t max_length)
+{
+    return end > max_length ? end - max_length : 0;
+}
+
+// Leaves in word_costs the cost of each word of text from a start
+// first to end - 1 up to boundary end, in order of start
+static inline void
+probe_ending(lexicon* lex, const char32_t* text, size_t first, size_t end, double* word_costs)
+{
+    for(size_t start=first;start<end;start++)
+        word_costs[start-first] = lexicon_get_cost_view(lex, u32view_make(text + start, end - start));
+}
+
+// Relaxation step of every bounded DP here: the cheapest path to
+// boundary end through the word from each start first to end - 1,
+// costing word_costs[start - first]. Ties go to the earlier start, the
+// longer word. A boundary no word reaches ends a single character
+// segment charged unknown, as in minseg_find_spans_text_with. Leaves
+// the start of the last word in *best_start.
+static inline double
+relax_end(const double* costs, size_t first, size_t end, const double* word_costs, 
+        double unknown, size_t* best_start)
+{
+    double min_cost = DBL_MAX;
+    size_t min_start = end - 1;
+    for(size_t start=first;start<end;start++)
+    {
+        double cost = costs[start] + word_costs[start-first];
+        if(cost < min_cost) 
+        {
+            min_cost = cost;
+            min_start = start;
+        }
+    }
+    if(min_cost == DBL_MAX) min_cost = costs[end-1] + unknown;
+    *best_start = min_start;
+    return min_cost;
+}
 
-    return -1 * log2(prob);
+static void
+workspace_reserve_probes(minseg_workspace* ws, size_t n_probes)
+{
+    if(n_probes <= ws->probes_capacity) return;
+    size_t capacity = ws->probes_capacity ? ws->probes_capacity : MINSEG_BATCH_PROBES;
+    while(capacity < n_probes) capacity *= 2;
+    ws->probe_words = realloc(ws->probe_words, capacity * sizeof(u32view));
+    ws->probe_hashes = realloc(ws->probe_hashes, capacity * sizeof(size_t));
+    ws->probe_costs = realloc(ws->probe_costs, capacity * sizeof(double));
+    if(ws->probe_words == NULL || ws->probe_hashes == NULL || ws->probe_costs == NULL) abort();
+    ws->probes_capacity = capacity;
 }
 
+// Leaves in ws->starts the start of the best word ending at each
+// position
 static void
-forward_step(lexicon* lex, const char32_t* sentence, char32_t** words, double* parse_cost)
+forward_step(minseg_workspace* ws, lexicon* lex, u32view sentence_view, double* parse_cost)
 {
-    size_t sentence_length = u32strlen(sentence);
+    const char32_t* sentence = sentence_view.str;
+    size_t sentence_length = sentence_view.len;
+    size_t max_length = lex->max_key_length;
+    double unknown = unknown_cost(lex->total_counts);
     
-    double* costs = calloc(sentence_length+1, sizeof(double));
-    char32_t* candidate_buffer = calloc(sentence_length + 1, sizeof(char32_t)); 
-    char32_t* min_cost_candidate = calloc(sentence_length + 1,sizeof(char32_t));
-    if(costs == NULL || candidate_buffer == NULL || min_cost_candidate == NULL) abort(); 
+    workspace_reserve(ws, sentence_length);
+    workspace_reserve_probes(ws, max_length);
+    double* costs = ws->costs;
+    size_t* starts = ws->starts;
+    costs[0] = 0;
+
+    for(size_t fpos=0;fpos<sentence_length;fpos++)
+    {
+        size_t first_ipos = first_start(fpos + 1, max_length);
+        probe_ending(lex, sentence, first_ipos, fpos + 1, ws->probe_costs);
+        costs[fpos+1] = relax_end(costs, first_ipos, fpos + 1, ws->probe_costs, unknown, &starts[fpos]);
+        *parse_cost = costs[fpos+1];
+    }
+}
+
+// Number of probes forward_step makes on a sentence: min(fpos + 1,
+// max_length) words end at each position
+static size_t
+probe_count(size_t length, size_t max_length)
+{
+    if(length <= max_length) return length * (length + 1) / 2;
+    return max_length * (max_length + 1) / 2 + (length - max_length) * max_length;
+}
+
+// forward_step with the word costs already looked up, in the order
+// forward_step probes them
+static void
+forward_step_costs(minseg_workspace* ws, size_t sentence_length, size_t max_length, 
+        double unknown, const double* word_costs, double* parse_cost)
+{
+    workspace_reserve(ws, sentence_length);
+    double* costs = ws->costs;
+    size_t* starts = ws->starts;
+    costs[0] = 0;
 
     for(size_t fpos=0;fpos<sentence_length;fpos++)
     {
-        double min_cost = DBL_MAX;
+        size_t first_ipos = first_start(fpos + 1, max_length);
+        costs[fpos+1] = relax_end(costs, first_ipos, fpos + 1, word_costs, unknown, &starts[fpos]);
+        *parse_cost = costs[fpos+1];
+        word_costs += fpos + 1 - first_ipos;
+    }
+}
+
+static void
+spans_reserve(minseg_spans* result, size_t size)
+{
+    if(size <= result->capacity) return;
+    while(result->capacity < size) result->capacity = 2 * result->capacity;
+    result->spans = realloc(result->spans, result->capacity * sizeof(minseg_span));
+    if(result->spans == NULL) abort();
+}
+
+// Reverses the spans backtracking left in result
+static void
+spans_reverse(minseg_spans* result)
+{
+    minseg_span temp;
+    for(size_t i=0;i<result->size/2;i++)
+    {
+        temp = result->spans[i];
+        result->spans[i] = result->spans[result->size-i-1];
+        result->spans[result->size-i-1] = temp;
+    }
+}
+
+static void 
+backtrack(minseg_workspace* ws, size_t words_size, minseg_spans* result)
+{
+    int64_t pos = words_size-1;
+    result->size = 0;
+
+    while(pos >= 0)
+    {
+        size_t wordlen = pos + 1 - ws->starts[pos];
+
+        spans_reserve(result, result->size + 1);
+        result->spans[result->size].offset = ws->starts[pos];
+        result->spans[result->size].length = wordlen;
+        result->spans[result->size].entry = MINSEG_NO_ENTRY;
+        result->size++;
+        pos = pos - wordlen;
+    }
+    spans_reverse(result);
+}
+
+minseg_spans*
+minseg_spans_create()
+{
+    minseg_spans* result = malloc(sizeof(minseg_spans));
+    if(result == NULL) abort();
+    result->capacity = MINSEG_SPANS_INITIAL_CAPACITY;
+    result->spans = malloc(result->capacity * sizeof(minseg_span));
+    if(result->spans == NULL) abort();
+    result->size = 0;
+    result->cost = 0;
+    return result;
+}
+
+void
+minseg_spans_free(minseg_spans* result)
+{
+    free(result->spans);
+    free(result);
+}
+
+void
+minseg_find_spans_with(minseg_workspace* ws, lexicon* lex, u32view sentence, minseg_spans* result)
+{
+    double cost = 0;
+    forward_step(ws,lex,sentence,&cost);
+    backtrack(ws,sentence.len,result);
+    result->cost = cost;
+}
+
+void
+minseg_find_spans(lexicon* lex, u32view sentence, minseg_spans* result)
+{
+    minseg_workspace* ws = minseg_workspace_create();
+    minseg_find_spans_with(ws,lex,sentence,result);
+    minseg_workspace_free(ws);
+}
+
+void
+minseg_find_spans_batch(lexicon* lex, const u32view* sentences, size_t n_sentences, 
+        minseg_spans** results)
+{
+    size_t max_length = lex->max_key_length;
+    minseg_workspace* ws = minseg_workspace_create();
+
+    size_t first = 0;
+    while(first < n_sentences)
+    {
+        size_t end = first, n_probes = 0;
+        while(end < n_sentences && (end == first || n_probes < MINSEG_BATCH_PROBES))
+        {
+            n_probes += probe_count(sentences[end].len, max_length);
+            end++;
+        }
+        workspace_reserve_probes(ws, n_probes);
+
+        size_t k = 0;
+        for(size_t s=first;s<end;s++)
+        {
+            for(size_t fpos=0;fpos<sentences[s].len;fpos++)
+            {
+                for(size_t ipos=first_start(fpos + 1, max_length);ipos<=fpos;ipos++)
+                    ws->probe_words[k++] = u32view_make(sentences[s].str + ipos, fpos-ipos+1);
+            }
+        }
+
+        // Probe k + MINSEG_BATCH_DISTANCE is prefetched as probe k is
+        // resolved, across sentence boundaries
+        size_t ahead = n_probes < MINSEG_BATCH_DISTANCE ? n_probes : MINSEG_BATCH_DISTANCE;
+        for(k=0;k<ahead;k++) ws->probe_hashes[k] = lexicon_prefetch_view(lex, ws->probe_words[k]);
+        for(k=0;k<n_probes;k++)
+        {
+            if(k + MINSEG_BATCH_DISTANCE < n_probes)
+            {
+                ws->probe_hashes[k + MINSEG_BATCH_DISTANCE] = 
+                    lexicon_prefetch_view(lex, ws->probe_words[k + MINSEG_BATCH_DISTANCE]);
+            }
+            ws->probe_costs[k] = lexicon_get_cost_hashed(lex, ws->probe_words[k], ws->probe_hashes[k]);
+        }
+
+        const double* word_costs = ws->probe_costs;
+        for(size_t s=first;s<end;s++)
+        {
+            double cost = 0;
+            forward_step_costs(ws, sentences[s].len, max_length, unknown_cost(lex->total_counts), 
+                    word_costs, &cost);
+            backtrack(ws, sentences[s].len, results[s]);
+            results[s]->cost = cost;
+            word_costs += probe_count(sentences[s].len, max_length);
+        }
+        first = end;
+    }
+    minseg_workspace_free(ws);
+}
+
+static minseg*
+minseg_from_spans(const char32_t* sentence, minseg_spans* spans)
+{
+    minseg* result = malloc(sizeof(minseg)); if(result == NULL) abort();
+    result->segments = malloc(spans->size * sizeof(char32_t*));
+    if(result->segments == NULL && spans->size) abort();
+
+    for(size_t i=0;i<spans->size;i++)
+    {
+        size_t wordlen = spans->spans[i].length;
+        result->segments[i] = malloc((wordlen + 1) * sizeof(char32_t)); 
+        if(result->segments[i] == NULL) abort();
+        u32strncpy(result->segments[i],sentence + spans->spans[i].offset,wordlen);
+    }
+    result->size = spans->size;
+    result->cost = spans->cost;
+    return result;
+}
+
+minseg* 
+minseg_create(lexicon* lex, const char32_t* sentence)
+{
+    minseg_spans* spans = minseg_spans_create();
+    minseg_find_spans(lex,u32view_from(sentence),spans);
+    minseg* result = minseg_from_spans(sentence,spans);
+    minseg_spans_free(spans);
+    return result;
+}
+
+
+void
+minseg_create_batch(lexicon* lex, const char32_t* const* sentences, size_t n_sentences, 
+        minseg** results)
+{
+    // Blocks of sentences share a few reused spans buffers
+    u32view views[MINSEG_BATCH_BLOCK];
+    minseg_spans* spans[MINSEG_BATCH_BLOCK];
+    for(size_t i=0;i<MINSEG_BATCH_BLOCK;i++) spans[i] = minseg_spans_create();
+
+    for(size_t first=0;first<n_sentences;first+=MINSEG_BATCH_BLOCK)
+    {
+        size_t n = n_sentences - first < MINSEG_BATCH_BLOCK ? n_sentences - first : MINSEG_BATCH_BLOCK;
+        for(size_t i=0;i<n;i++) views[i] = u32view_from(sentences[first + i]);
+        minseg_find_spans_batch(lex,views,n,spans);
+        for(size_t i=0;i<n;i++) results[first + i] = minseg_from_spans(sentences[first + i],spans[i]);
+    }
+    for(size_t i=0;i<MINSEG_BATCH_BLOCK;i++) minseg_spans_free(spans[i]);
+}
+
+void 
+minseg_free(minseg* result)
+{
+    for(size_t i=0;i<result->size;i++) free(result->segments[i]);
+    free(result->segments);
+    free(result);
+}
+
+
+minseg_lattice*
+minseg_lattice_create()
+{
+    minseg_lattice* lattice = calloc(1, sizeof(minseg_lattice));
+    if(lattice == NULL) abort();
+    return lattice;
+}
+
+void
+minseg_lattice_free(minseg_lattice* lattice)
+{
+    free(lattice->arcs);
+    free(lattice->end_offsets);
+    free(lattice->paths);
+    free(lattice->n_paths);
+    free(lattice->probe_costs);
+    free(lattice);
+}
+
+static void
+lattice_reserve_positions(minseg_lattice* lattice, size_t length)
+{
+    if(length + 1 <= lattice->positions_capacity) return;
+    size_t capacity = lattice->positions_capacity ? lattice->positions_capacity : MINSEG_WORKSPACE_INITIAL_POSITIONS;
+    while(capacity < length + 1) capacity *= 2;
+    lattice->end_offsets = realloc(lattice->end_offsets, capacity * sizeof(size_t));
+    lattice->n_paths = realloc(lattice->n_paths, capacity * sizeof(size_t));
+    if(lattice->end_offsets == NULL || lattice->n_paths == NULL) abort();
+    lattice->positions_capacity = capacity;
+}
+
+static void
+lattice_push_arc(minseg_lattice* lattice, size_t start, size_t end, double cost)
+{
+    if(lattice->n_arcs == lattice->arcs_capacity)
+    {
+        lattice->arcs_capacity = lattice->arcs_capacity ? 2 * lattice->arcs_capacity : MINSEG_LATTICE_INITIAL_ARCS;
+        lattice->arcs = realloc(lattice->arcs, lattice->arcs_capacity * sizeof(minseg_arc));
+        if(lattice->arcs == NULL) abort();
+    }
+    minseg_arc* arc = &lattice->arcs[lattice->n_arcs++];
+    arc->start = (uint32_t) start;
+    arc->end = (uint32_t) end;
+    arc->cost = cost;
+}
+
+void
+minseg_find_lattice(lexicon* lex, u32view sentence, minseg_lattice* lattice)
+{
+    size_t max_length = lex->max_key_length;
+    lattice_reserve_positions(lattice, sentence.len);
+    lattice->length = sentence.len;
+    lattice->n_arcs = 0;
+    lattice->end_offsets[0] = 0;
+
+    if(max_length > lattice->probes_capacity)
+    {
+        lattice->probe_costs = realloc(lattice->probe_costs, max_length * sizeof(double));
+        if(lattice->probe_costs == NULL) abort();
+        lattice->probes_capacity = max_length;
+    }
 
-        for(size_t ipos=0;ipos<=fpos;ipos++)
+    // Same probes as forward_step, so the words found are the ones it
+    // chooses from
+    for(size_t fpos=0;fpos<sentence.len;fpos++)
+    {
+        size_t first_arc = lattice->n_arcs;
+        size_t first_ipos = first_start(fpos + 1, max_length);
+        probe_ending(lex, sentence.str, first_ipos, fpos + 1, lattice->probe_costs);
+        for(size_t ipos=first_ipos;ipos<=fpos;ipos++)
         {
-            u32strncpy(candidate_buffer,(sentence + ipos),(fpos-ipos+1)); 
+            double cost = lattice->probe_costs[ipos-first_ipos];
+            if(cost != DBL_MAX) lattice_push_arc(lattice, ipos, fpos + 1, cost);
+        }
+        // and a position no word reaches gets the fallback of relax_end
+        if(lattice->n_arcs == first_arc) 
+            lattice_push_arc(lattice, fpos, fpos + 1, unknown_cost(lex->total_counts));
+        lattice->end_offsets[fpos+1] = lattice->n_arcs;
+    }
+}
+
+// Cheaper first, then the earlier arc (the longer word) and the
+// better ranked path before it
+static bool
+path_before(const minseg_path* a, const minseg_path* b)
+{
+    if(a->cost != b->cost) return a->cost < b->cost;
+    if(a->arc != b->arc) return a->arc < b->arc;
+    return a->rank < b->rank;
+}
+
+// Max heap on path_before, so the worst kept path is at the top
+static void
+paths_sift_down(minseg_path* heap, size_t size, size_t i)
+{
+    while(1)
+    {
+        size_t largest = i, left = 2 * i + 1, right = left + 1;
+        if(left < size && path_before(&heap[largest],&heap[left])) largest = left;
+        if(right < size && path_before(&heap[largest],&heap[right])) largest = right;
+        if(largest == i) return;
+        minseg_path temp = heap[i]; heap[i] = heap[largest]; heap[largest] = temp;
+        i = largest;
+    }
+}
+
+static void
+paths_sift_up(minseg_path* heap, size_t i)
+{
+    while(i > 0 && path_before(&heap[(i-1)/2],&heap[i]))
+    {
+        minseg_path temp = heap[i]; heap[i] = heap[(i-1)/2]; heap[(i-1)/2] = temp;
+        i = (i-1)/2;
+    }
+}
 
-            double cost = costs[ipos] + lexicon_lookup(lex, candidate_buffer);
+size_t
+minseg_lattice_nbest(minseg_lattice* lattice, size_t k, minseg_spans** results)
+{
+    if(k == 0) return 0;
+    size_t length = lattice->length;
+    if((length + 1) * k > lattice->paths_capacity)
+    {
+        lattice->paths_capacity = (length + 1) * k;
+        lattice->paths = realloc(lattice->paths, lattice->paths_capacity * sizeof(minseg_path));
+        if(lattice->paths == NULL) abort();
+    }
+    minseg_path* paths = lattice->paths;
+    size_t* n_paths = lattice->n_paths;
 
+    paths[0].cost = 0;
+    paths[0].arc = 0;
+    paths[0].rank = 0;
+    n_paths[0] = 1;
 
-            if(cost < min_cost) 
+    // The k best paths to a position extend the k best paths to the
+    // start of each arc ending there, kept in a bounded heap and then
+    // sorted in place
+    for(size_t end=1;end<=length;end++)
+    {
+        minseg_path* heap = paths + end * k;
+        size_t size = 0;
+        for(size_t a=lattice->end_offsets[end-1];a<lattice->end_offsets[end];a++)
+        {
+            const minseg_arc* arc = &lattice->arcs[a];
+            const minseg_path* before = paths + arc->start * k;
+            for(size_t r=0;r<n_paths[arc->start];r++)
             {
-                min_cost = cost;
-                memset(min_cost_candidate,0,sentence_length * 4);
-                u32strcpy(min_cost_candidate,candidate_buffer);  
+                minseg_path candidate = { before[r].cost + arc->cost, (uint32_t) a, (uint32_t) r };
+                if(size < k)
+                {
+                    heap[size] = candidate;
+                    paths_sift_up(heap, size++);
+                }
+                // The paths before are sorted, so later ranks lose too
+                else if(!path_before(&candidate,&heap[0])) break;
+                else
+                {
+                    heap[0] = candidate;
+                    paths_sift_down(heap, size, 0);
+                }
             }
-            memset(candidate_buffer,0,sentence_length * 4);
         }
-        costs[fpos+1] = min_cost;
-        *parse_cost = min_cost;
+        for(size_t i=size;i>1;i--)
+        {
+            minseg_path temp = heap[0]; heap[0] = heap[i-1]; heap[i-1] = temp;
+            paths_sift_down(heap, i - 1, 0);
+        }
+        n_paths[end] = size;
+    }
+
+    size_t n_results = n_paths[length];
+    for(size_t q=0;q<n_results;q++)
+    {
+        minseg_spans* result = results[q];
+        result->size = 0;
+        result->cost = paths[length * k + q].cost;
+        size_t rank = q;
+        for(size_t pos=length;pos>0;)
+        {
+            const minseg_path* path = &paths[pos * k + rank];
+            const minseg_arc* arc = &lattice->arcs[path->arc];
+            spans_reserve(result, result->size + 1);
+            result->spans[result->size].offset = arc->start;
+            result->spans[result->size].length = arc->end - arc->start;
+            result->spans[result->size].entry = MINSEG_NO_ENTRY;
+            result->size++;
+            rank = path->rank;
+            pos = arc->start;
+        }
+        spans_reverse(result);
+    }
+    return n_results;
+}
 
-        words[fpos] = calloc((u32strlen(min_cost_candidate) + 1),sizeof(char32_t));
-        if(words[fpos] == NULL) abort();
+size_t
+minseg_find_nbest(lexicon* lex, u32view sentence, size_t k, minseg_spans** results)
+{
+    minseg_lattice* lattice = minseg_lattice_create();
+    minseg_find_lattice(lex,sentence,lattice);
+    size_t n_results = minseg_lattice_nbest(lattice,k,results);
+    minseg_lattice_free(lattice);
+    return n_results;
+}
+
+// The magic is written without its '\0'
+#define LATTICE_MAGIC_SIZE (sizeof(MINSEG_LATTICE_MAGIC) - 1)
+
+bool
+minseg_lattice_write(const minseg_lattice* lattice, FILE* out)
+{
+    uint64_t header[2] = { lattice->length, lattice->n_arcs };
+    if(fwrite(MINSEG_LATTICE_MAGIC, 1, LATTICE_MAGIC_SIZE, out) != LATTICE_MAGIC_SIZE) return false;
+    if(fwrite(header, sizeof(uint64_t), 2, out) != 2) return false;
+    return fwrite(lattice->arcs, sizeof(minseg_arc), lattice->n_arcs, out) == lattice->n_arcs;
+}
 
-        u32strcpy(words[fpos],min_cost_candidate); 
+bool
+minseg_lattice_read(minseg_lattice* lattice, FILE* in)
+{
+    lattice->length = 0;
+    lattice->n_arcs = 0;
+    char magic[LATTICE_MAGIC_SIZE];
+    uint64_t header[2];
+    if(fread(magic, 1, sizeof(magic), in) != sizeof(magic)) return false;
+    if(memcmp(magic, MINSEG_LATTICE_MAGIC, sizeof(magic)) != 0) return false;
+    if(fread(header, sizeof(uint64_t), 2, in) != 2) return false;
+    uint64_t length = header[0], n_arcs = header[1];
+    // At most length arcs end at each position, so a corrupt count
+    // cannot ask for an absurd allocation
+    if(length > UINT32_MAX || n_arcs > length * length) return false;
+
+    lattice_reserve_positions(lattice, length);
+    if(n_arcs > lattice->arcs_capacity)
+    {
+        lattice->arcs = realloc(lattice->arcs, n_arcs * sizeof(minseg_arc));
+        if(lattice->arcs == NULL) abort();
+        lattice->arcs_capacity = n_arcs;
     }
+    if(fread(lattice->arcs, sizeof(minseg_arc), n_arcs, in) != n_arcs) return false;
 
-    free(candidate_buffer); 
-    free(min_cost_candidate); 
-    free(costs);
-   
+    // The arcs come in order of end, so the offsets are rebuilt in
+    // one pass
+    size_t pos = 0;
+    lattice->end_offsets[0] = 0;
+    for(size_t a=0;a<n_arcs;a++)
+    {
+        const minseg_arc* arc = &lattice->arcs[a];
+        if(arc->start >= arc->end || arc->end > length || arc->end <= pos) return false;
+        while(pos + 1 < arc->end) lattice->end_offsets[++pos] = a;
+    }
+    while(pos < length) lattice->end_offsets[++pos] = n_arcs;
+    lattice->length = length;
+    lattice->n_arcs = n_arcs;
+    return true;
 }
 
-static void 
-backtrack(char32_t** words, size_t words_size,char32_t** minseg_words, size_t* minseg_words_size)
+
+minseg_stream*
+minseg_stream_create(lexicon* lex, minseg_stream_fn emit, void* context)
 {
-    int64_t pos = words_size-1;
-    size_t minseg_words_sz = 0;
-    size_t i = 0;
+    minseg_stream* stream = calloc(1, sizeof(minseg_stream));
+    if(stream == NULL) abort();
+    stream->lex = lex;
+    stream->emit = emit;
+    stream->context = context;
+    stream->max_length = lex->max_key_length ? lex->max_key_length : 1;
+    // A forced commit keeps the last max_length characters open, so
+    // the window must leave room to make progress
+    stream->window = MINSEG_STREAM_WINDOW;
+    if(stream->window < 4 * stream->max_length) stream->window = 4 * stream->max_length;
+    stream->unknown_cost = unknown_cost(lex->total_counts);
 
-    while(pos >= 0)
+    stream->chars = malloc(stream->window * sizeof(char32_t));
+    stream->costs = malloc((stream->window + 1) * sizeof(double));
+    stream->starts = malloc((stream->window + 1) * sizeof(uint64_t));
+    stream->path = malloc((stream->window + 1) * sizeof(size_t));
+    stream->probe_costs = malloc(stream->max_length * sizeof(double));
+    if(stream->chars == NULL || stream->costs == NULL || stream->starts == NULL || 
+       stream->path == NULL || stream->probe_costs == NULL) abort();
+    stream->costs[0] = 0;
+    stream->starts[0] = 0;
+    return stream;
+}
+
+void
+minseg_stream_free(minseg_stream* stream)
+{
+    free(stream->chars);
+    free(stream->costs);
+    free(stream->starts);
+    free(stream->path);
+    free(stream->probe_costs);
+    free(stream);
+}
+
+// Start of the last word of the best path to pending boundary end
+static inline size_t
+stream_start(const minseg_stream* stream, size_t end)
+{
+    return (size_t) (stream->starts[end] - stream->base);
+}
+
+// Best path to pending boundary end, with the probes and tie breaking
+// of forward_step. No word starts before the committed boundary.
+static void
+stream_relax(minseg_stream* stream, size_t end)
+{
+    size_t first = first_start(end, stream->max_length);
+    size_t min_start;
+    probe_ending(stream->lex, stream->chars, first, end, stream->probe_costs);
+    stream->costs[end] = relax_end(stream->costs, first, end, stream->probe_costs, stream->unknown_cost, &min_start);
+    stream->starts[end] = stream->base + min_start;
+}
+
+// Emits the best path to pending boundary end and makes end the
+// committed boundary
+static void
+stream_commit(minseg_stream* stream, size_t end)
+{
+    if(end == 0) return;
+    size_t n = 0;
+    for(size_t pos=end;pos>0;pos=stream_start(stream,pos)) stream->path[n++] = pos;
+    size_t start = 0;
+    while(n > 0)
+    {
+        size_t pos = stream->path[--n];
+        stream->emit(stream->context, u32view_make(stream->chars + start, pos - start), stream->base + start);
+        start = pos;
+    }
+
+    size_t rest = stream->length - end;
+    memmove(stream->chars, stream->chars + end, rest * sizeof(char32_t));
+    memmove(stream->costs, stream->costs + end, (rest + 1) * sizeof(double));
+    memmove(stream->starts, stream->starts + end, (rest + 1) * sizeof(uint64_t));
+    stream->length = rest;
+    stream->base += end;
+}
+
+// Commits the latest boundary every open path runs through. A future
+// word can start at any of the last max_length boundaries, so the
+// commit point is the common ancestor of their best paths; starts
+// always point back, so stepping the later of two boundaries finds it.
+static void
+stream_commit_settled(minseg_stream* stream)
+{
+    size_t end = stream->length;
+    size_t first = first_start(end + 1, stream->max_length);
+    size_t common = end;
+    for(size_t pos=first;pos<end;pos++)
     {
-        size_t wordlen = u32strlen(words[pos]);
-        if(minseg_words != NULL) 
+        size_t x = pos;
+        while(x != common)
         {
-            minseg_words[i] = malloc((wordlen + 1) * sizeof(char32_t)); 
-            if(minseg_words[i] == NULL)  abort();
-            u32strcpy(minseg_words[i],words[pos]);
-        } 
-        minseg_words_sz++;
-        pos = pos - wordlen;
-        i++;
+            if(x > common) x = stream_start(stream,x);
+            else common = stream_start(stream,common);
+        }
     }
+    stream_commit(stream,common);
+}
 
+// Commits the best path to the end up to the last boundary at least
+// max_length characters back, then redoes the open part from there
+static void
+stream_force_commit(minseg_stream* stream)
+{
+    size_t pos = stream->length;
+    while(pos > 0 && pos + stream->max_length > stream->length) pos = stream_start(stream,pos);
+    stream_commit(stream,pos);
+    for(size_t end=1;end<=stream->length;end++) stream_relax(stream,end);
+    stream->forced_commits++;
+}
 
-    // Reverse result array
-    if(minseg_words == NULL) 
+void
+minseg_stream_push(minseg_stream* stream, u32view text)
+{
+    for(size_t i=0;i<text.len;i++)
     {
-        *minseg_words_size = minseg_words_sz;
-        return;
+        if(stream->length == stream->window)
+        {
+            stream_commit_settled(stream);
+            if(2 * stream->length > stream->window) stream_force_commit(stream);
+        }
+        stream->chars[stream->length++] = text.str[i];
+        stream_relax(stream,stream->length);
     }
-    
-    char32_t* temp;
-    for(size_t i=0;i<minseg_words_sz/2;i++)
+    stream_commit_settled(stream);
+}
+
+void
+minseg_stream_finish(minseg_stream* stream)
+{
+    stream_commit(stream,stream->length);
+}
+
+// Length of the bytes of buffer that end with a whole UTF8 sequence
+static size_t
+utf8_whole_prefix(const char* buffer, size_t size)
+{
+    for(size_t back=1;back<=4 && back<=size;back++)
     {
-        temp = minseg_words[i];
-        minseg_words[i] = minseg_words[minseg_words_sz-i-1];
-        minseg_words[minseg_words_sz-i-1] = temp;
+        unsigned char c = (unsigned char) buffer[size-back];
+        if((c & 0xC0) == 0x80) continue;
+        // an invalid lead byte is decoded on its own, as u8to32_n does
+        size_t need = u8seqlen(c);
+        return need > back ? size - back : size;
     }
+    return size;
 }
 
+bool
+minseg_stream_read_fd(minseg_stream* stream, int fd)
+{
+    char* bytes = malloc(MINSEG_STREAM_CHUNK + 4);
+    char32_t* chars = malloc((MINSEG_STREAM_CHUNK + 4 + 1) * sizeof(char32_t));
+    if(bytes == NULL || chars == NULL) abort();
+
+    // A sequence cut by the end of a chunk is carried to the next one
+    size_t carried = 0;
+    bool ok = true;
+    while(1)
+    {
+        long got = (long) read(fd, bytes + carried, MINSEG_STREAM_CHUNK);
+        if(got < 0) { ok = false; break; }
+        size_t size = carried + (size_t) got;
+        // A sequence still cut at end of file is dropped
+        size_t whole = utf8_whole_prefix(bytes,size);
+        size_t n_chars = u8to32_n(bytes,whole,chars);
 
-minseg* 
-minseg_create(lexicon* lex, const char32_t* sentence)
+        size_t line = 0;
+        for(size_t i=0;i<=n_chars;i++)
+        {
+            if(i < n_chars && chars[i] != '\n' && chars[i] != '\r') continue;
+            minseg_stream_push(stream, u32view_make(chars + line, i - line));
+            line = i + 1;
+        }
+
+        carried = size - whole;
+        memmove(bytes, bytes + whole, carried);
+        if(got == 0) break;
+    }
+    minseg_stream_finish(stream);
+
+    free(bytes);
+    free(chars);
+    return ok;
+}
+
+
+minseg_cache*
+minseg_cache_create(lexicon* lex, size_t capacity)
 {
-    minseg* result = NULL;
-   
-    size_t chosen_words_sz = u32strlen(sentence);
-    char32_t** chosen_words = calloc(chosen_words_sz, sizeof(char32_t*));
-    if(chosen_words == NULL) abort();
+    minseg_cache* cache = malloc(sizeof(minseg_cache));
+    if(cache == NULL) abort();
+    if(capacity == 0) capacity = 1;
+    cache->lex = lex;
+    cache->ws = minseg_workspace_create();
+    cache->capacity = capacity;
+    cache->n_entries = 0;
+    cache->hand = 0;
+    cache->entries = calloc(capacity, sizeof(minseg_cache_entry));
+    // at most half the slots are in use
+    cache->slots_capacity = 2;
+    while(cache->slots_capacity < 2 * capacity) cache->slots_capacity *= 2;
+    cache->slots = calloc(cache->slots_capacity, sizeof(uint32_t));
+    if(cache->entries == NULL || cache->slots == NULL) abort();
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    return cache;
+}
 
-    double cost = 0;
-    forward_step(lex,sentence,chosen_words, &cost);
+void
+minseg_cache_free(minseg_cache* cache)
+{
+    for(size_t i=0;i<cache->n_entries;i++)
+    {
+        free(cache->entries[i].sentence);
+        free(cache->entries[i].spans);
+    }
+    free(cache->entries);
+    free(cache->slots);
+    minseg_workspace_free(cache->ws);
+    free(cache);
+}
 
-    size_t segments_sz = 0;
-    backtrack(chosen_words, chosen_words_sz, NULL, &segments_sz);
+// Slot holding the entry for sentence, or the empty slot where it
+// would go
+static size_t
+cache_slot(minseg_cache* cache, uint64_t hsh, u32view sentence)
+{
+    size_t mask = cache->slots_capacity - 1;
+    size_t slot = hsh & mask;
+    while(cache->slots[slot])
+    {
+        minseg_cache_entry* entry = &cache->entries[cache->slots[slot] - 1];
+        if(entry->hash == hsh && 
+           u32view_eq(u32view_make(entry->sentence,entry->length),sentence)) return slot;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
 
-    result = malloc(sizeof(minseg)); if(result == NULL) abort();
-    result->segments = malloc(segments_sz * sizeof(char32_t*));
-    if(result->segments == NULL) abort();
+// Empties slot, moving back the entries after it that would no longer
+// be found
+static void
+cache_remove_slot(minseg_cache* cache, size_t slot)
+{
+    size_t mask = cache->slots_capacity - 1;
+    size_t hole = slot;
+    cache->slots[hole] = 0;
+    for(size_t next=(hole + 1) & mask;cache->slots[next];next=(next + 1) & mask)
+    {
+        size_t home = cache->entries[cache->slots[next] - 1].hash & mask;
+        // move it if its home is not in the cyclic range (hole, next]
+        bool reachable = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+        if(reachable) continue;
+        cache->slots[hole] = cache->slots[next];
+        cache->slots[next] = 0;
+        hole = next;
+    }
+}
 
-    backtrack(chosen_words, chosen_words_sz, result->segments, &segments_sz);
-    result->size = segments_sz;
-    result->cost = cost;
-    
+// Entry to reuse for a new sentence, chosen by CLOCK once the cache is
+// full
+static size_t
+cache_victim(minseg_cache* cache)
+{
+    if(cache->n_entries < cache->capacity) return cache->n_entries++;
+
+    while(cache->entries[cache->hand].referenced)
+    {
+        cache->entries[cache->hand].referenced = false;
+        cache->hand = (cache->hand + 1) % cache->capacity;
+    }
+    size_t victim = cache->hand;
+    cache->hand = (cache->hand + 1) % cache->capacity;
+
+    minseg_cache_entry* entry = &cache->entries[victim];
+    cache_remove_slot(cache,cache_slot(cache,entry->hash,u32view_make(entry->sentence,entry->length)));
+    cache->evictions++;
+    return victim;
+}
+
+static void
+cache_store(minseg_cache_entry* entry, const minseg_spans* result)
+{
+    if(result->size > entry->spans_capacity)
+    {
+        entry->spans_capacity = result->size;
+        entry->spans = realloc(entry->spans, entry->spans_capacity * sizeof(minseg_span));
+        if(entry->spans == NULL) abort();
+    }
+    memcpy(entry->spans, result->spans, result->size * sizeof(minseg_span));
+    entry->n_spans = result->size;
+    entry->cost = result->cost;
+    entry->referenced = true;
+}
+
+void
+minseg_find_spans_cached(minseg_cache* cache, u32view sentence, minseg_spans* result)
+{
+    uint64_t hsh = u32view_hash(sentence);
+    size_t slot = cache_slot(cache,hsh,sentence);
+    minseg_cache_entry* entry = cache->slots[slot] ? &cache->entries[cache->slots[slot] - 1] : NULL;
+
+    if(entry != NULL && entry->version == cache->lex->version)
+    {
+        cache->hits++;
+        entry->referenced = true;
+        spans_reserve(result, entry->n_spans);
+        memcpy(result->spans, entry->spans, entry->n_spans * sizeof(minseg_span));
+        result->size = entry->n_spans;
+        result->cost = entry->cost;
+        return;
+    }
+
+    cache->misses++;
+    minseg_find_spans_with(cache->ws,cache->lex,sentence,result);
+    if(entry == NULL)
+    {
+        entry = &cache->entries[cache_victim(cache)];
+        entry->hash = hsh;
+        entry->length = sentence.len;
+        entry->sentence = realloc(entry->sentence, (sentence.len + 1) * sizeof(char32_t));
+        if(entry->sentence == NULL) abort();
+        u32view_copy(entry->sentence,sentence);
+        // eviction may have moved entries around
+        slot = cache_slot(cache,hsh,sentence);
+        cache->slots[slot] = (uint32_t) (entry - cache->entries) + 1;
+    }
+    entry->version = cache->lex->version;
+    cache_store(entry,result);
+}
+
+minseg* 
+minseg_create_cached(minseg_cache* cache, const char32_t* sentence)
+{
+    minseg_spans* spans = minseg_spans_create();
+    minseg_find_spans_cached(cache,u32view_from(sentence),spans);
+    minseg* result = minseg_from_spans(sentence,spans);
+    minseg_spans_free(spans);
     return result;
+}
+
+
+#define INDEX_INITIAL_NODES 1024
+#define INDEX_INITIAL_EDGES 2048
+#define INDEX_LOAD_FACTOR 0.5
+#define INDEX_NO_NODE MINSEG_NO_ENTRY
 
+static inline size_t
+edge_slot(uint64_t key, size_t capacity)
+{
+    // capacity is always a power of two
+    return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
 }
 
+static inline uint64_t
+edge_key(uint32_t node, char32_t character)
+{
+    return ((uint64_t) node << 32) | (uint64_t) character;
+}
 
-void 
-minseg_free(minseg* result)
+static uint32_t
+index_child(minseg_index* index, uint32_t node, char32_t character)
 {
-    for(size_t i=0;i<result->size;i++) free(result->segments[i]);
-    free(result->segments);
-    free(result);
+    uint64_t key = edge_key(node,character);
+    size_t slot = edge_slot(key,index->edges_capacity);
+    while(index->edge_targets[slot] != INDEX_NO_NODE)
+    {
+        if(index->edge_keys[slot] == key) return index->edge_targets[slot];
+        slot = (slot + 1) & (index->edges_capacity - 1);
+    }
+    return INDEX_NO_NODE;
+}
+
+static void
+index_put_edge(uint64_t* keys, uint32_t* targets, size_t capacity, uint64_t key, uint32_t target)
+{
+    size_t slot = edge_slot(key,capacity);
+    while(targets[slot] != INDEX_NO_NODE) slot = (slot + 1) & (capacity - 1);
+    keys[slot] = key;
+    targets[slot] = target;
+}
+
+static void
+index_grow_edges(minseg_index* index)
+{
+    size_t new_capacity = 2 * index->edges_capacity;
+    uint64_t* keys = malloc(new_capacity * sizeof(uint64_t));
+    uint32_t* targets = calloc(new_capacity, sizeof(uint32_t));
+    if(keys == NULL || targets == NULL) abort();
+
+    for(size_t i=0;i<index->edges_capacity;i++)
+    {
+        if(index->edge_targets[i] == INDEX_NO_NODE) continue;
+        index_put_edge(keys,targets,new_capacity,index->edge_keys[i],index->edge_targets[i]);
+    }
+
+    free(index->edge_keys);
+    free(index->edge_targets);
+    index->edge_keys = keys;
+    index->edge_targets = targets;
+    index->edges_capacity = new_capacity;
+}
+
+static uint32_t
+index_new_node(minseg_index* index, uint32_t parent, char32_t label)
+{
+    if(index->n_nodes == index->nodes_capacity)
+    {
+        index->nodes_capacity = 2 * index->nodes_capacity;
+        index->counts = realloc(index->counts, index->nodes_capacity * sizeof(uint64_t));
+        index->costs = realloc(index->costs, index->nodes_capacity * sizeof(double));
+        index->parents = realloc(index->parents, index->nodes_capacity * sizeof(uint32_t));
+        index->labels = realloc(index->labels, index->nodes_capacity * sizeof(char32_t));
+        if(index->counts == NULL || index->costs == NULL || 
+           index->parents == NULL || index->labels == NULL) abort();
+    }
+    index->counts[index->n_nodes] = 0;
+    index->costs[index->n_nodes] = DBL_MAX;
+    index->parents[index->n_nodes] = parent;
+    index->labels[index->n_nodes] = label;
+    return (uint32_t) index->n_nodes++;
+}
+
+uint32_t
+minseg_index_add(minseg_index* index, u32view word, size_t count)
+{
+    uint32_t node = 0;
+    for(size_t len=0;len<word.len;len++)
+    {
+        uint32_t child = index_child(index,node,word.str[len]);
+        if(child == INDEX_NO_NODE)
+        {
+            if((double) (index->n_edges + 1) / index->edges_capacity >= INDEX_LOAD_FACTOR) 
+                index_grow_edges(index);
+            child = index_new_node(index,node,word.str[len]);
+            index_put_edge(index->edge_keys,index->edge_targets,index->edges_capacity,
+                    edge_key(node,word.str[len]),child);
+            index->n_edges++;
+        }
+        node = child;
+    }
+
+    index->counts[node] += count;
+    index->total_counts += count;
+    if(word.len > index->max_key_length) index->max_key_length = word.len;
+    index->scored = false;
+    return node;
+}
+
+void
+minseg_index_add_node(minseg_index* index, uint32_t node, size_t count)
+{
+    index->counts[node] += count;
+    index->total_counts += count;
+    index->scored = false;
+}
+
+void
+minseg_index_set_count(minseg_index* index, uint32_t node, size_t count)
+{
+    index->total_counts = index->total_counts - index->counts[node] + count;
+    index->counts[node] = count;
+    index->scored = false;
+}
+
+void
+minseg_index_score(minseg_index* index)
+{
+    for(size_t i=0;i<index->n_nodes;i++)
+    {
+        if(index->counts[i] == 0) index->costs[i] = DBL_MAX;
+        else 
+        {
+            double prob = (double) index->counts[i]/index->total_counts;
+            index->costs[i] = -1 * log2(prob);
+        }
+    }
+    index->scored = true;
+}
+
+size_t
+minseg_index_key(const minseg_index* index, uint32_t node, char32_t* dest)
+{
+    size_t len = 0;
+    for(uint32_t n=node;n!=0;n=index->parents[n]) len++;
+    dest[len] = 0;
+    size_t pos = len;
+    for(uint32_t n=node;n!=0;n=index->parents[n]) dest[--pos] = index->labels[n];
+    return len;
+}
+
+minseg_index*
+minseg_index_create(lexicon* lex)
+{
+    minseg_index* index = malloc(sizeof(minseg_index));
+    if(index == NULL) abort();
+
+    index->nodes_capacity = INDEX_INITIAL_NODES;
+    index->n_nodes = 0;
+    index->counts = malloc(INDEX_INITIAL_NODES * sizeof(uint64_t));
+    index->costs = malloc(INDEX_INITIAL_NODES * sizeof(double));
+    index->parents = malloc(INDEX_INITIAL_NODES * sizeof(uint32_t));
+    index->labels = malloc(INDEX_INITIAL_NODES * sizeof(char32_t));
+    index->edges_capacity = INDEX_INITIAL_EDGES;
+    index->n_edges = 0;
+    index->edge_keys = malloc(INDEX_INITIAL_EDGES * sizeof(uint64_t));
+    index->edge_targets = calloc(INDEX_INITIAL_EDGES, sizeof(uint32_t));
+    if(index->counts == NULL || index->costs == NULL || 
+       index->parents == NULL || index->labels == NULL ||
+       index->edge_keys == NULL || index->edge_targets == NULL) abort();
+    index->total_counts = 0;
+    index->max_key_length = 0;
+
+    index_new_node(index,0,0); // root
+
+    for(size_t i=0;i<lex->capacity;i++)
+    {
+        if(lex->table[i].key == NULL) continue;
+        minseg_index_add(index,u32view_make(lex->table[i].key,lex->table[i].length),
+                lex->table[i].count);
+    }
+    minseg_index_score(index);
+
+    return index;
+}
+
+void
+minseg_index_free(minseg_index* index)
+{
+    free(index->counts);
+    free(index->costs);
+    free(index->parents);
+    free(index->labels);
+    free(index->edge_keys);
+    free(index->edge_targets);
+    free(index);
+}
+
+void
+minseg_find_spans_indexed(minseg_index* index, u32view sentence, minseg_spans* result)
+{
+    minseg_text text = minseg_text_from_view(sentence);
+    minseg_find_spans_text(index,&text,result);
+}
+
+void
+minseg_find_spans_text(minseg_index* index, const minseg_text* sentence, minseg_spans* result)
+{
+    minseg_workspace* ws = minseg_workspace_create();
+    minseg_find_spans_text_with(ws,index,sentence,result);
+    minseg_workspace_free(ws);
+}
+
+void
+minseg_find_spans_text_with(minseg_workspace* ws, minseg_index* index, const minseg_text* sentence, 
+        minseg_spans* result)
+{
+    size_t length = sentence->len;
+    double unknown = unknown_cost(index->total_counts);
+
+    workspace_reserve(ws, length);
+    double* costs = ws->costs;
+    size_t* starts = ws->starts;
+    uint32_t* entries = ws->entries;
+
+    costs[0] = 0;
+    for(size_t i=1;i<=length;i++) 
+    {
+        costs[i] = DBL_MAX;
+        // Unreachable positions fall back to a single character
+        starts[i] = i - 1;
+        entries[i] = MINSEG_NO_ENTRY;
+    }
+
+    // Relaxing in increasing start order keeps the first (longest) 
+    // candidate on ties, exactly like forward_step
+    for(size_t ipos=0;ipos<length;ipos++)
+    {
+        // Every word ending at ipos has been relaxed by now
+        if(costs[ipos] == DBL_MAX) costs[ipos] = costs[ipos-1] + unknown;
+        uint32_t node = 0;
+        for(size_t fpos=ipos;fpos<length;fpos++)
+        {
+            node = index_child(index,node,minseg_text_at(sentence,fpos));
+            if(node == INDEX_NO_NODE) break;
+
+            double cost = costs[ipos] + index->costs[node];
+            if(cost < costs[fpos+1])
+            {
+                costs[fpos+1] = cost;
+                starts[fpos+1] = ipos;
+                entries[fpos+1] = node;
+            }
+        }
+    }
+
+    if(length && costs[length] == DBL_MAX) costs[length] = costs[length-1] + unknown;
+
+    result->size = 0;
+    for(size_t pos=length;pos>0;pos=starts[pos])
+    {
+        spans_reserve(result, result->size + 1);
+        result->spans[result->size].offset = starts[pos];
+        result->spans[result->size].length = pos - starts[pos];
+        result->spans[result->size].entry = entries[pos];
+        result->size++;
+    }
+    spans_reverse(result);
+    result->cost = length ? costs[length] : 0;
+}
+
+minseg* 
+minseg_create_indexed(minseg_index* index, const char32_t* sentence)
+{
+    minseg_spans* spans = minseg_spans_create();
+    minseg_find_spans_indexed(index,u32view_from(sentence),spans);
+    minseg* result = minseg_from_spans(sentence,spans);
+    minseg_spans_free(spans);
+    return result;
 }
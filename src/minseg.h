@@ -2,7 +2,10 @@
 #define __MINSEG_H__
 
 #include <uchar.h>
+#include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include "cu32.h"
 #include "lexicon.h"
 
 typedef struct minseg
@@ -12,12 +15,390 @@ typedef struct minseg
     double cost;
 } minseg;
 
+// Segments found through a minseg_index carry the trie node of their
+// word in entry; MINSEG_NO_ENTRY marks segments that are not in the
+// index and every segment from the lexicon path.
+#define MINSEG_NO_ENTRY 0
+
+typedef struct minseg_span
+{
+    size_t offset;
+    size_t length;
+    uint32_t entry;
+} minseg_span;
+
+// Segmentation as (offset, length) spans into the caller's sentence.
+// The spans buffer grows as needed and is reused across calls.
+typedef struct minseg_spans
+{
+    minseg_span* spans;
+    size_t size;
+    size_t capacity;
+    double cost;
+} minseg_spans;
+
+#define MINSEG_SPANS_INITIAL_CAPACITY 64
+
+// Sentence read through a symbol table: each of the len symbols is
+// width bytes (1, 2 or 4) and stands for symbols[id]. With a NULL
+// table the data are the characters themselves, four bytes each.
+typedef struct minseg_text
+{
+    const void* data;
+    size_t len;
+    uint8_t width;
+    const char32_t* symbols;
+} minseg_text;
+
+static inline minseg_text
+minseg_text_from_view(u32view sentence)
+{
+    minseg_text text = { sentence.str, sentence.len, sizeof(char32_t), NULL };
+    return text;
+}
+
+static inline char32_t
+minseg_text_at(const minseg_text* text, size_t i)
+{
+    uint32_t id;
+    switch(text->width)
+    {
+        case 1: id = ((const uint8_t*) text->data)[i]; break;
+        case 2: id = ((const uint16_t*) text->data)[i]; break;
+        default: id = ((const uint32_t*) text->data)[i]; break;
+    }
+    return text->symbols == NULL ? (char32_t) id : text->symbols[id];
+}
+
+// Prefix trie over the keys of a lexicon. Transitions live in a single
+// open addressing table keyed by (node, character), so a walk from a
+// start position finds every word beginning there without hashing or
+// copying substrings.
+typedef struct minseg_index
+{
+    uint64_t* counts;
+    double* costs;
+    // Parent and incoming character of each node, to spell its key
+    uint32_t* parents;
+    char32_t* labels;
+    size_t n_nodes;
+    size_t nodes_capacity;
+
+    uint64_t* edge_keys;
+    uint32_t* edge_targets;
+    size_t n_edges;
+    size_t edges_capacity;
+
+    uint64_t total_counts;
+    size_t max_key_length;
+    bool scored;
+} minseg_index;
+
+#define MINSEG_WORKSPACE_INITIAL_POSITIONS 256
+
+// Scratch buffers of a segmentation, grown as needed and kept between
+// calls so that the _with functions do not allocate once they have
+// seen the longest sentence. A workspace serves one call at a time.
+typedef struct minseg_workspace
+{
+    double* costs;
+    // Start of the best word ending at each position
+    size_t* starts;
+    uint32_t* entries;
+    size_t positions_capacity;
+
+    // Words probed by a batch, with their hashes and costs
+    u32view* probe_words;
+    size_t* probe_hashes;
+    double* probe_costs;
+    size_t probes_capacity;
+} minseg_workspace;
+
+// A batch is cut into groups of about MINSEG_BATCH_PROBES lexicon
+// probes, resolved MINSEG_BATCH_DISTANCE probes behind their prefetch
+#define MINSEG_BATCH_PROBES 4096
+#define MINSEG_BATCH_DISTANCE 16
+// Sentences minseg_create_batch segments per call of
+// minseg_find_spans_batch
+#define MINSEG_BATCH_BLOCK 256
+
+// Word of the lexicon spanning characters start to end - 1 of a
+// sentence, at its code length
+typedef struct minseg_arc
+{
+    uint32_t start;
+    uint32_t end;
+    double cost;
+} minseg_arc;
+
+// Best paths reaching a position of a lattice: the arc taken last and
+// the rank of the path it extends at the start of that arc
+typedef struct minseg_path
+{
+    double cost;
+    uint32_t arc;
+    uint32_t rank;
+} minseg_path;
+
+// Every lexicon word found in a sentence of length characters, as
+// arcs between positions 0 to length, plus a one character arc at the
+// unknown cost ending each position no word reaches. The arcs ending
+// at position j are arcs[end_offsets[j-1]] up to arcs[end_offsets[j]],
+// in order of increasing start, and end_offsets[0] is 0. The buffers
+// grow as needed and are reused across calls.
+typedef struct minseg_lattice
+{
+    minseg_arc* arcs;
+    size_t n_arcs;
+    size_t arcs_capacity;
+    size_t* end_offsets;
+    size_t length;
+    size_t positions_capacity;
+
+    // Scratch of minseg_lattice_nbest, k paths per position
+    minseg_path* paths;
+    size_t* n_paths;
+    size_t paths_capacity;
+
+    // Scratch of minseg_find_lattice, the costs of the words ending at
+    // a position
+    double* probe_costs;
+    size_t probes_capacity;
+} minseg_lattice;
+
+#define MINSEG_LATTICE_INITIAL_ARCS 1024
+#define MINSEG_LATTICE_MAGIC "MSLAT001"
+
+// Receives each committed segment of a stream, with the offset of its
+// first character in the whole text
+typedef void (*minseg_stream_fn)(void* context, u32view word, uint64_t offset);
+
+// Segmenter of text arriving in pieces. It keeps only the characters
+// whose segmentation is still open: a boundary is committed once the
+// best paths to every position a future word may start from all run
+// through it, and the segments before it are handed to emit. When the
+// paths stay apart for a whole window, the best one so far is
+// committed anyway. That is the only case where the result can differ
+// from minseg_find_spans over the whole text, which charges characters
+// no word covers the same unknown_cost.
+typedef struct minseg_stream
+{
+    lexicon* lex;
+    minseg_stream_fn emit;
+    void* context;
+    // Pending characters, the first one at offset base of the text
+    char32_t* chars;
+    size_t length;
+    uint64_t base;
+    // Per pending boundary: cost of the best path to it and absolute
+    // start of the last word of that path. Boundary 0 is committed.
+    double* costs;
+    uint64_t* starts;
+    size_t* path;
+    // Costs of the words ending at the boundary being relaxed
+    double* probe_costs;
+    size_t window;
+    size_t max_length;
+    // Charged for a character no word covers, as by minseg_find_spans
+    double unknown_cost;
+    uint64_t forced_commits;
+} minseg_stream;
+
+#define MINSEG_STREAM_WINDOW 8192
+#define MINSEG_STREAM_CHUNK 16384
+
+// Segmentation of a sentence kept by a minseg_cache
+typedef struct minseg_cache_entry
+{
+    uint64_t hash;
+    uint64_t version;
+    char32_t* sentence;
+    size_t length;
+    minseg_span* spans;
+    size_t n_spans;
+    size_t spans_capacity;
+    double cost;
+    bool referenced;
+} minseg_cache_entry;
+
+// Bounded memo of minseg_create results for one lexicon. Entries are
+// found by sentence hash and are only valid for the lexicon version
+// they were computed at; a full cache evicts by CLOCK.
+typedef struct minseg_cache
+{
+    lexicon* lex;
+    minseg_workspace* ws;
+    minseg_cache_entry* entries;
+    size_t n_entries;
+    size_t capacity;
+    size_t hand;
+    // Entry number + 1 of each slot, 0 when empty, probed linearly
+    uint32_t* slots;
+    size_t slots_capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} minseg_cache;
+
+// The lexicon functions only read the lexicon, so several threads can
+// segment with the same one. Score it with lexicon_score once it is
+// built: an unscored lexicon still works but pays a log2 per probe.
 minseg* 
 minseg_create(lexicon* lex, const char32_t* sentence);
 
+minseg_lattice*
+minseg_lattice_create();
+
+void
+minseg_lattice_free(minseg_lattice* lattice);
+
+// Probes the lexicon once for every substring of the sentence no
+// longer than its longest key and keeps the words found as arcs
+void
+minseg_find_lattice(lexicon* lex, u32view sentence, minseg_lattice* lattice);
+
+// Writes the k cheapest segmentations of the lattice to results[0]
+// to results[k-1], cheapest first; ties go to the longer last word, so
+// results[0] is what minseg_find_spans gives. Returns how many were
+// written, which is less than k only when the lattice holds fewer
+// paths.
+size_t
+minseg_lattice_nbest(minseg_lattice* lattice, size_t k, minseg_spans** results);
+
+// minseg_find_lattice followed by minseg_lattice_nbest
+size_t
+minseg_find_nbest(lexicon* lex, u32view sentence, size_t k, minseg_spans** results);
+
+// Writes the lattice in binary, in the byte order of the host: the
+// magic bytes, the sentence length and the number of arcs as uint64_t,
+// then the arcs as stored. Returns false if a write fails.
+bool
+minseg_lattice_write(const minseg_lattice* lattice, FILE* out);
+
+// Reads a lattice written by minseg_lattice_write into lattice,
+// replacing its arcs and reusing its buffers. Returns false, leaving
+// an empty lattice, if the input is short or not a valid lattice.
+bool
+minseg_lattice_read(minseg_lattice* lattice, FILE* in);
+
+// The lexicon must not change while the stream is open
+minseg_stream*
+minseg_stream_create(lexicon* lex, minseg_stream_fn emit, void* context);
+
+void
+minseg_stream_free(minseg_stream* stream);
+
+// Appends text and emits the segments it settles
+void
+minseg_stream_push(minseg_stream* stream, u32view text);
+
+// Emits the rest of the best segmentation. The stream can then take a
+// new text, whose offsets continue from this one.
+void
+minseg_stream_finish(minseg_stream* stream);
+
+// Pushes UTF8 read from fd in chunks of MINSEG_STREAM_CHUNK bytes,
+// leaving out line breaks, and finishes the stream at end of file.
+// Returns false on a read error.
+bool
+minseg_stream_read_fd(minseg_stream* stream, int fd);
+
+minseg_cache*
+minseg_cache_create(lexicon* lex, size_t capacity);
+
+void
+minseg_cache_free(minseg_cache* cache);
+
+// Like minseg_find_spans, answered from the cache when the sentence
+// was segmented before at the current lexicon version
+void
+minseg_find_spans_cached(minseg_cache* cache, u32view sentence, minseg_spans* result);
+
+minseg* 
+minseg_create_cached(minseg_cache* cache, const char32_t* sentence);
+
 void 
 minseg_free (minseg* result);
 
+minseg_spans*
+minseg_spans_create();
+
+void
+minseg_spans_free(minseg_spans* result);
+
+minseg_workspace*
+minseg_workspace_create();
+
+void
+minseg_workspace_free(minseg_workspace* ws);
+
+// Every segmentation ends a one character segment at a position no
+// word reaches and charges it log2(total_counts + 1), about the code
+// length of a word seen once, so the words after it are still found
+void
+minseg_find_spans(lexicon* lex, u32view sentence, minseg_spans* result);
+
+void
+minseg_find_spans_with(minseg_workspace* ws, lexicon* lex, u32view sentence, minseg_spans* result);
+
+// Segments many sentences at once, with the results minseg_find_spans
+// would give. The probes of a group of sentences are independent of
+// its DP, so they are issued as one stream and prefetched ahead,
+// overlapping the cache misses of the table instead of waiting on each.
+// This only pays off for tables larger than the cache.
+void
+minseg_find_spans_batch(lexicon* lex, const u32view* sentences, size_t n_sentences, 
+        minseg_spans** results);
+
+// minseg_create over each sentence, written to results
+void
+minseg_create_batch(lexicon* lex, const char32_t* const* sentences, size_t n_sentences, 
+        minseg** results);
+
+minseg_index*
+minseg_index_create(lexicon* lex);
+
+// Returns the node of word, created with its prefixes if missing.
+// Node IDs never change, so they can key data kept beside the index.
+uint32_t
+minseg_index_add(minseg_index* index, u32view word, size_t count);
+
+// Adds count to the word ending at node, a node of the trie
+void
+minseg_index_add_node(minseg_index* index, uint32_t node, size_t count);
+
+// Replaces the count of node, keeping the total in step
+void
+minseg_index_set_count(minseg_index* index, uint32_t node, size_t count);
+
+void
+minseg_index_score(minseg_index* index);
+
+// Writes the key of node to dest, NUL terminated, and returns its
+// length. dest must hold index->max_key_length + 1 characters.
+size_t
+minseg_index_key(const minseg_index* index, uint32_t node, char32_t* dest);
+
+void
+minseg_index_free(minseg_index* index);
+
+// The indexed functions only read the index, so several threads can
+// segment with the same one. They use the costs of the last
+// minseg_index_score: minseg_index_create leaves the index scored, and
+// callers that change counts score it again before segmenting.
+minseg* 
+minseg_create_indexed(minseg_index* index, const char32_t* sentence);
+
+void
+minseg_find_spans_indexed(minseg_index* index, u32view sentence, minseg_spans* result);
+
+void
+minseg_find_spans_text(minseg_index* index, const minseg_text* sentence, minseg_spans* result);
+
+void
+minseg_find_spans_text_with(minseg_workspace* ws, minseg_index* index, const minseg_text* sentence, 
+        minseg_spans* result);
+
 #endif
 
 
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cu32.h"
+
+#define BENCH_ROUNDS 20
+
+static int failures = 0;
+
+static void
+check(int condition, const char* description)
+{
+    if(!condition) failures++;
+    printf("%s: %s\n", condition ? "ok   " : "FALHA", description);
+}
+
+static void
+validation_tests()
+{
+    char32_t u32[64];
+    char u8[256];
+    size_t err = 0;
+
+    const char* text = "ação 日本 𝄞 abcdefghijklmnopqrstuvwxyz";
+    size_t len = u8to32_utf(text, strlen(text), u32, &err);
+    check(len == 36, "numero de caracteres");
+    check(u32[1] == 0xE7 && u32[5] == 0x65E5 && u32[8] == 0x1D11E, "pontos de codigo");
+    check(u32to8_utf(u32, len, u8, &err) == strlen(text) && strcmp(u8, text) == 0, 
+            "ida e volta");
+
+    check(u8to32_utf("ab\xC3", 3, u32, &err) == CU32_INVALID && err == 2, "sequencia truncada");
+    check(u8to32_utf("a\xC0\xAF", 3, u32, &err) == CU32_INVALID && err == 1, "forma longa demais");
+    check(u8to32_utf("a\xE0\x80\xAF", 4, u32, &err) == CU32_INVALID && err == 1, 
+            "forma longa demais de 3 bytes");
+    check(u8to32_utf("\xED\xA0\x80", 3, u32, &err) == CU32_INVALID && err == 0, "surrogate");
+    check(u8to32_utf("\xF4\x90\x80\x80", 4, u32, &err) == CU32_INVALID, "acima de U+10FFFF");
+    check(u8to32_utf("0123456789abcdef\x80", 17, u32, &err) == CU32_INVALID && err == 16, 
+            "continuacao isolada apos bloco ASCII");
+
+    char32_t surrogate[] = { 'a', 0xD800 };
+    check(u32to8_utf(surrogate, 2, u8, &err) == CU32_INVALID && err == 1, "codifica surrogate");
+    char32_t too_big[] = { 0x110000 };
+    check(u32to8_utf(too_big, 1, u8, &err) == CU32_INVALID && err == 0, "codifica acima de U+10FFFF");
+}
+
+static char*
+read_file(const char* filename, size_t* size)
+{
+    FILE* fptr = fopen(filename, "rb");
+    if(fptr == NULL) return NULL;
+    fseek(fptr, 0, SEEK_END);
+    *size = (size_t) ftell(fptr);
+    fseek(fptr, 0, SEEK_SET);
+    char* data = malloc(*size + 1);
+    if(data == NULL) abort();
+    *size = fread(data, 1, *size, fptr);
+    data[*size] = '\0';
+    fclose(fptr);
+    return data;
+}
+
+static double
+mb_per_sec(size_t bytes, clock_t start, clock_t end)
+{
+    double sec = (double) (end - start) / CLOCKS_PER_SEC;
+    return (double) bytes * BENCH_ROUNDS / (1024 * 1024) / sec;
+}
+
+// Vazao das rotinas legadas e das novas sobre a lista de palavras,
+// no arquivo inteiro e linha a linha, que e como a segmentacao as usa:
+// palavras curtas, uma de cada vez.
+static void
+throughput_benchmark(const char* filename)
+{
+    size_t size = 0;
+    char* data = read_file(filename, &size);
+    if(data == NULL) 
+    {
+        printf("Arquivo %s nao encontrado\n", filename);
+        return;
+    }
+
+    char32_t* u32 = malloc((size + 1) * sizeof(char32_t));
+    char* u8 = malloc(4 * size + 1);
+    if(u32 == NULL || u8 == NULL) abort();
+
+    clock_t start = clock();
+    for(int r=0;r<BENCH_ROUNDS;r++) u8to32(data, u32);
+    printf("u8to32 (legado):  %8.1f MB/s\n", mb_per_sec(size, start, clock()));
+
+    size_t len = 0;
+    start = clock();
+    for(int r=0;r<BENCH_ROUNDS;r++) len = u8to32_utf(data, size, u32, NULL);
+    printf("u8to32_utf:       %8.1f MB/s\n", mb_per_sec(size, start, clock()));
+    check(len != CU32_INVALID, "lista de palavras e UTF8 valido");
+
+    start = clock();
+    for(int r=0;r<BENCH_ROUNDS;r++) u32to8_utf(u32, len, u8, NULL);
+    printf("u32to8_utf:       %8.1f MB/s\n", mb_per_sec(size, start, clock()));
+    check(memcmp(u8, data, size) == 0, "lista de palavras ida e volta");
+
+    // Linha a linha, com as rotinas legadas sobre o formato empacotado
+    size_t n_lines = 0;
+    for(size_t i=0;i<size;i++) if(data[i] == '\n') { data[i] = '\0'; n_lines++; }
+    char32_t line32[256];
+    char line8[1024];
+
+    start = clock();
+    for(int r=0;r<BENCH_ROUNDS;r++)
+    {
+        for(char* line=data;line<data+size;line+=strlen(line)+1) 
+        {
+            u8to32(line, line32);
+            u32to8(line32, line8);
+        }
+    }
+    printf("linhas, legado:   %8.1f MB/s (%zu linhas)\n", mb_per_sec(size, start, clock()), n_lines);
+
+    start = clock();
+    for(int r=0;r<BENCH_ROUNDS;r++)
+    {
+        for(char* line=data;line<data+size;line+=strlen(line)+1) 
+        {
+            size_t line_len = u8to32_utf(line, strlen(line), line32, NULL);
+            u32to8_utf(line32, line_len, line8, NULL);
+        }
+    }
+    printf("linhas, utf:      %8.1f MB/s\n", mb_per_sec(size, start, clock()));
+
+    free(data);
+    free(u32);
+    free(u8);
+}
+
+int main()
+{
+    validation_tests();
+    throughput_benchmark("./test_res/wordlist.txt");
+    printf("%d falhas\n", failures);
+    return failures ? -1 : 0;
+}
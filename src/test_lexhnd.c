@@ -3,13 +3,25 @@
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <math.h>
 #include "lexhnd.h"
 #include "cu32.h"
 
-#define CORPUS_SIZE 710813
 #define WORD_SZ 80
+// Palavras da execucao pequena pela interface legada
+#define SMALL_WORDS 2000
 
-int main()
+// Custo de uma chave soletrada caractere a caractere
+static double
+spelling_cost(lexicon* chars, u32view key)
+{
+    double cost = 0;
+    for(size_t c=0;c<key.len;c++) cost += lexicon_get_cost_view(chars,u32view_make(key.str + c,1));
+    return cost;
+}
+
+// Uso: test_lexhnd [numero de threads]
+int main(int argc, char* argv[])
 {
     
     clock_t tot_s = clock(), corpus_s = clock();
@@ -22,29 +34,41 @@ int main()
 
     
     char buffer[WORD_SZ] = {'\0'};
-    char32_t** corpus = calloc(CORPUS_SIZE,sizeof(char32_t*)); 
+    char32_t word[WORD_SZ];
+    lexhnd_corpus* corpus = lexhnd_corpus_create();
+    lexicon* chars = lexicon_create();
+    char32_t* small_words[SMALL_WORDS];
+    size_t n_small = 0;
     
-    size_t i = 0;
     while(fgets(buffer,WORD_SZ-1,fptr))
     {
         buffer[strcspn(buffer,"\n")] = '\0'; 
-        char32_t* word = calloc(WORD_SZ, sizeof(char32_t));
-        if(word == NULL)
+        size_t len = u8to32(buffer,word);
+        lexhnd_corpus_add(corpus,u32view_from(word));
+        if(n_small < SMALL_WORDS)
         {
-            printf("Word allocation error!\n");
-            return -1;
+            small_words[n_small] = malloc((len + 1) * sizeof(char32_t));
+            if(small_words[n_small] == NULL) abort();
+            u32strcpy(small_words[n_small++],word);
         }
-        u8to32(buffer,word);
-        corpus[i] = word;
-        i++;
+        for(size_t c=0;c<len;c++) lexicon_add_view(chars,u32view_make(word + c,1),1);
     }
+    fclose(fptr);
+    lexicon_score(chars);
 
     clock_t corpus_end = clock();
     double sec = ((double) corpus_end - corpus_s) / CLOCKS_PER_SEC;
+    size_t i = lexhnd_corpus_size(corpus);
     printf("Carregou o corpus em %lf s\n", sec); 
+    printf("Corpus compactado: %zu bytes (%zu em palavras de %d caracteres)\n", 
+            lexhnd_corpus_bytes(corpus), i * WORD_SZ * sizeof(char32_t), WORD_SZ);
 
     clock_t proc_s = clock();
-    lexhnd_result* res = lexhnd_run(corpus,i,15,25);
+    lexhnd_options options;
+    options.n_iterations = 15;
+    options.n_new_words = 25;
+    options.n_threads = argc > 1 ? (size_t) atoi(argv[1]) : 0;
+    lexhnd_result* res = lexhnd_run_corpus(corpus,&options);
     clock_t proc_e = clock();
 
 
@@ -60,14 +84,82 @@ int main()
                 res->priors[i] + res->posteriors[i]
               );
     }
-    
 
-    for(size_t j=0;j<CORPUS_SIZE;j++)
+    // As priors sao mantidas por diferencas; recalcula cada uma por inteiro
+    double max_prior_diff = 0;
+    for(int i=0;i<15;i++)
     {
-        free(corpus[j]);
+        double prior = 0;
+        size_t cursor = 0;
+        litem* item;
+        while((item = lexicon_next_item(res->lexicons[i],&cursor)) != NULL)
+            prior += spelling_cost(chars,u32view_make(item->key,item->length));
+        double diff = fabs(prior - res->priors[i]) / res->priors[i];
+        if(diff > max_prior_diff) max_prior_diff = diff;
     }
+    printf("Maior diferenca relativa das priors recalculadas: %g\n", max_prior_diff);
+    assert(max_prior_diff < 1e-9);
+
+    // O resultado nao depende do numero de threads: compara com uma
+    // execucao de 1 thread (ou de 4, se a primeira pode ter sido de 1)
+    lexhnd_options threads_options = options;
+    threads_options.n_threads = options.n_threads <= 1 ? 4 : 1;
+    proc_s = clock();
+    lexhnd_result* res_threads = lexhnd_run_corpus(corpus,&threads_options);
+    proc_e = clock();
+    sec = (double) (proc_e - proc_s) / CLOCKS_PER_SEC;
+    size_t threads_diffs = 0;
+    for(int i=0;i<15;i++)
+        if(res_threads->priors[i] != res->priors[i] || res_threads->posteriors[i] != res->posteriors[i]) threads_diffs++;
+    printf("Com %zu threads em %lfs, %zu iteracoes divergentes\n", 
+            threads_options.n_threads, sec, threads_diffs);
+    assert(threads_diffs == 0);
+
+    // A interface legada lexhnd_run deve dar o mesmo que
+    // lexhnd_run_corpus sobre as mesmas palavras
+    lexhnd_options small_options;
+    small_options.n_iterations = 5;
+    small_options.n_new_words = 10;
+    small_options.n_threads = 0;
+    lexhnd_corpus* small_corpus = lexhnd_corpus_create();
+    for(size_t w=0;w<n_small;w++) lexhnd_corpus_add(small_corpus,u32view_from(small_words[w]));
+    lexhnd_result* res_legacy = lexhnd_run(small_words,n_small,small_options.n_iterations,small_options.n_new_words);
+    lexhnd_result* res_small = lexhnd_run_corpus(small_corpus,&small_options);
+    size_t legacy_diffs = 0;
+    for(int i=0;i<small_options.n_iterations;i++)
+    {
+        if(res_legacy->priors[i] != res_small->priors[i] || res_legacy->posteriors[i] != res_small->posteriors[i]) 
+            legacy_diffs++;
+        if(res_legacy->lexicons[i]->occupancy != res_small->lexicons[i]->occupancy) legacy_diffs++;
+    }
+    printf("lexhnd_run sobre %zu palavras: %zu iteracoes divergentes\n", n_small, legacy_diffs);
+    assert(legacy_diffs == 0);
+    lexhnd_corpus_free(small_corpus);
+    for(size_t w=0;w<n_small;w++) free(small_words[w]);
+
+    // Mesma execucao sobre as palavras distintas com suas contagens
+    lexicon* types = lexicon_create();
+    lexicon_populate_from_wordlist_file(types,"./test_res/wordlist.txt");
+    proc_s = clock();
+    lexhnd_result* res_types = lexhnd_run_types(types,&options);
+    proc_e = clock();
+    sec = (double) (proc_e - proc_s) / CLOCKS_PER_SEC;
+    double max_diff = 0;
+    for(int i=0;i<15;i++)
+    {
+        double h = res->priors[i] + res->posteriors[i];
+        double h_types = res_types->priors[i] + res_types->posteriors[i];
+        double diff = fabs(h - h_types) / h;
+        if(diff > max_diff) max_diff = diff;
+    }
+    printf("Por tipos (%llu tipos) em %lfs, maior diferenca relativa em h: %g\n", 
+            types->occupancy, sec, max_diff);
+    assert(max_diff < 1e-9);
     
-    free(corpus);
+
+    lexicon_free(types);
+    lexicon_free(chars);
+    lexhnd_corpus_free(corpus);
 
     
 }
@@ -6,6 +6,61 @@
 #include <stdio.h>
 #include <time.h>
 
+#define BENCH_ROUNDS 5
+
+// Consulta todas as substrings de cada chave, como faz a segmentacao:
+// a maioria das consultas sao falhas. Retorna o tempo em segundos.
+static float
+probe_benchmark(lexicon* lex, litem** items, size_t n_items, uint64_t* hits, uint64_t* probes)
+{
+    *hits = 0;
+    *probes = 0;
+    clock_t start = clock();
+    for(int r=0;r<BENCH_ROUNDS;r++)
+    {
+        for(size_t i=0;i<n_items;i++)
+        {
+            const char32_t* key = items[i]->key;
+            size_t len = items[i]->length;
+            for(size_t a=0;a<len;a++)
+            {
+                for(size_t b=a+1;b<=len;b++)
+                {
+                    if(lexicon_get_count_view(lex,u32view_make(key + a,b - a))) (*hits)++;
+                    (*probes)++;
+                }
+            }
+        }
+    }
+    return (float) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+// As duas sondagens devem achar exatamente as mesmas chaves. Retorna o
+// numero de divergencias.
+static size_t
+compare_backends(lexicon* lex)
+{
+    lexicon* swiss = lexicon_create_backend(LEXICON_BACKEND_SWISS);
+    clock_t start = clock();
+    lexicon_populate_from_wordlist_file(swiss,"./test_res/wordlist.txt");
+    float load = (float) (clock() - start) / CLOCKS_PER_SEC;
+    printf("Tabela swiss carregada em: %fs\n", load);
+
+    litem** items = malloc(lex->occupancy * sizeof(litem*));
+    if(items == NULL) abort();
+    lexicon_get_items(lex, items);
+
+    uint64_t hits, probes, swiss_hits, swiss_probes;
+    float linear_sec = probe_benchmark(lex,items,lex->occupancy,&hits,&probes);
+    printf("Sondagem linear: %llu consultas, %llu acertos, %fs\n", probes, hits, linear_sec);
+    float swiss_sec = probe_benchmark(swiss,items,lex->occupancy,&swiss_hits,&swiss_probes);
+    printf("Sondagem swiss:  %llu consultas, %llu acertos, %fs\n", swiss_probes, swiss_hits, swiss_sec);
+
+    free(items);
+    lexicon_free(swiss);
+    return (hits != swiss_hits) + (probes != swiss_probes);
+}
+
 int main(int argc, char* argv[])
 {
     lexicon* lex = lexicon_create();
@@ -20,7 +75,22 @@ int main(int argc, char* argv[])
            "Quantidade de palavras: %llu\n"
            "Quantidade de tokens: %llu\n", sec, lex->occupancy, lex->total_counts);
 
-     
+
+    #define HISTOGRAM_BINS 16
+    uint64_t histogram[HISTOGRAM_BINS];
+    uint64_t total_distance = lexicon_probe_histogram(lex,histogram,HISTOGRAM_BINS);
+    printf("Capacidade: %llu\nDistancia de sondagem:\n", lex->capacity);
+    for(size_t i=0;i<HISTOGRAM_BINS;i++)
+    {
+        printf("%3zu%s %llu\n", i, i + 1 == HISTOGRAM_BINS ? "+" : " ", histogram[i]);
+    }
+    printf("Media: %f\n", (double) total_distance / lex->occupancy);
+
+    if(compare_backends(lex)) 
+    {
+        printf("Sondagem swiss divergiu da linear\n");
+        return -1;
+    }
 
     while(1)
     {
@@ -36,13 +106,25 @@ int main(int argc, char* argv[])
 
     size_t lex_sz = lex->occupancy;
     litem** li = malloc(lex_sz * sizeof(litem*));
+    if(li == NULL) abort();
+    start = clock();
     lexicon_get_items(lex, li);
+    float sort_sec = (float) (clock() - start) / CLOCKS_PER_SEC;
+
+    #define TOP_K 20
+    litem* top[TOP_K];
+    start = clock();
+    size_t n_top = lexicon_top_items(lex,top,TOP_K);
+    float top_sec = (float) (clock() - start) / CLOCKS_PER_SEC;
+    size_t mismatches = 0;
+    for(size_t i=0;i<n_top;i++) if(top[i] != li[i]) mismatches++;
+    printf("Ordenacao completa: %fs, top %d: %fs, %zu diferencas\n", sort_sec, TOP_K, top_sec, mismatches);
 
     char buff[80];
-    for(size_t i=0;i<20;i++)
+    for(size_t i=0;i<n_top;i++)
     {
-        u32to8(li[i]->key,buff);
-        printf("%s - %llu\n", buff, li[i]->count);
+        u32to8(top[i]->key,buff);
+        printf("%s - %llu\n", buff, top[i]->count);
     }
 
     free(li);
@@ -1,11 +1,671 @@
+// fileno e POSIX, nao C11
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <float.h>
+#include <math.h>
 #include "minseg.h"
 #include "lexicon.h"
 #include "cu32.h"
 
+// Linhas de um arquivo convertidas para char32_t, de qualquer tamanho
+typedef struct wordlist
+{
+    char32_t** lines;
+    size_t* lengths;
+    size_t n_lines;
+    size_t max_length;
+} wordlist;
+
+#define WORDLIST_INIT_LINES 1024
+#define WORDLIST_INIT_BYTES 128
+
+// Le no maximo max_lines linhas de filename, ou todas se max_lines e
+// 0, sem a quebra de linha. Devolve NULL se o arquivo nao abre.
+static wordlist*
+wordlist_load(const char* filename, size_t max_lines)
+{
+    FILE* fptr = fopen(filename,"r");
+    if(fptr == NULL) return NULL;
+
+    wordlist* wl = malloc(sizeof(wordlist));
+    if(wl == NULL) abort();
+    size_t capacity = WORDLIST_INIT_LINES;
+    wl->lines = malloc(capacity * sizeof(char32_t*));
+    wl->lengths = malloc(capacity * sizeof(size_t));
+    wl->n_lines = 0;
+    wl->max_length = 0;
+    size_t buffer_sz = WORDLIST_INIT_BYTES;
+    char* buffer = malloc(buffer_sz);
+    if(wl->lines == NULL || wl->lengths == NULL || buffer == NULL) abort();
+
+    while(max_lines == 0 || wl->n_lines < max_lines)
+    {
+        // fgets em pedacos, dobrando o buffer, ate achar o fim da linha
+        size_t bytes = 0;
+        while(fgets(buffer + bytes,(int) (buffer_sz - bytes),fptr))
+        {
+            bytes += strlen(buffer + bytes);
+            if(bytes > 0 && buffer[bytes-1] == '\n') break;
+            buffer_sz *= 2;
+            buffer = realloc(buffer, buffer_sz);
+            if(buffer == NULL) abort();
+        }
+        if(bytes == 0) break;
+        if(buffer[bytes-1] == '\n') bytes--;
+
+        if(wl->n_lines == capacity)
+        {
+            capacity *= 2;
+            wl->lines = realloc(wl->lines, capacity * sizeof(char32_t*));
+            wl->lengths = realloc(wl->lengths, capacity * sizeof(size_t));
+            if(wl->lines == NULL || wl->lengths == NULL) abort();
+        }
+        char32_t* line = malloc((bytes + 1) * sizeof(char32_t));
+        if(line == NULL) abort();
+        size_t len = u8to32_n(buffer,bytes,line);
+        wl->lines[wl->n_lines] = line;
+        wl->lengths[wl->n_lines] = len;
+        wl->n_lines++;
+        if(len > wl->max_length) wl->max_length = len;
+    }
+    free(buffer);
+    fclose(fptr);
+    return wl;
+}
+
+static void
+wordlist_free(wordlist* wl)
+{
+    for(size_t i=0;i<wl->n_lines;i++) free(wl->lines[i]);
+    free(wl->lines);
+    free(wl->lengths);
+    free(wl);
+}
+
+#define DIFF_WORDS 30000
+#define DIFF_MAX_GROUP 8
+
+// Segmentacao de referencia: a programacao dinamica sem limite de
+// tamanho de chave, que testa todas as posicoes iniciais, com o mesmo
+// custo de caractere desconhecido onde nenhuma palavra termina.
+static minseg*
+reference_minseg(lexicon* lex, const char32_t* sentence)
+{
+    size_t len = u32strlen(sentence);
+    double* costs = calloc(len + 1, sizeof(double));
+    size_t* starts = calloc(len + 1, sizeof(size_t));
+    char32_t* buffer = calloc(len + 1, sizeof(char32_t));
+    if(costs == NULL || starts == NULL || buffer == NULL) abort();
+
+    for(size_t fpos=0;fpos<len;fpos++)
+    {
+        double min_cost = DBL_MAX;
+        // sem palavra que chegue aqui, o ultimo caractere fica sozinho e
+        // custa como uma palavra vista uma vez
+        starts[fpos] = fpos;
+        for(size_t ipos=0;ipos<=fpos;ipos++)
+        {
+            u32strncpy(buffer,sentence + ipos,fpos-ipos+1);
+            size_t count = lexicon_get_count(lex,buffer);
+            double lookup = count == 0 ? DBL_MAX : 
+                -1 * log2((double) count/lex->total_counts);
+            double cost = costs[ipos] + lookup;
+            if(cost < min_cost)
+            {
+                min_cost = cost;
+                starts[fpos] = ipos;
+            }
+        }
+        if(min_cost == DBL_MAX) min_cost = costs[fpos] + log2((double) lex->total_counts + 1);
+        costs[fpos+1] = min_cost;
+    }
+
+    minseg* res = malloc(sizeof(minseg)); if(res == NULL) abort();
+    res->segments = malloc(len * sizeof(char32_t*));
+    if(res->segments == NULL && len) abort();
+    res->size = 0;
+    res->cost = len ? costs[len] : 0;
+
+    // Reconstroi de tras para frente e inverte
+    for(int64_t pos=(int64_t) len-1;pos>=0;pos=(int64_t) starts[pos]-1)
+    {
+        size_t wlen = pos - starts[pos] + 1;
+        char32_t* seg = calloc(wlen + 1, sizeof(char32_t)); if(seg == NULL) abort();
+        u32strncpy(seg,sentence + starts[pos],wlen);
+        res->segments[res->size++] = seg;
+    }
+    for(size_t i=0;i<res->size/2;i++)
+    {
+        char32_t* tmp = res->segments[i];
+        res->segments[i] = res->segments[res->size-i-1];
+        res->segments[res->size-i-1] = tmp;
+    }
+
+    free(costs); free(starts); free(buffer);
+    return res;
+}
+
+static int8_t
+minseg_equal(minseg* a, minseg* b)
+{
+    if(a->size != b->size || a->cost != b->cost) return 0;
+    for(size_t k=0;k<a->size;k++)
+        if(!u32streq(a->segments[k],b->segments[k])) return 0;
+    return 1;
+}
+
+// Teste diferencial: frases sem espacos formadas pela concatenacao de
+// palavras consecutivas da lista devem ter a mesma segmentacao e o mesmo
+// custo em minseg_create, minseg_create_indexed e na implementacao de
+// referencia. Algumas frases recebem no meio um caractere fora do
+// lexico. Um workspace reutilizado entre as frases deve dar os mesmos
+// intervalos que minseg_create.
+#define DIFF_OOV_EVERY 5
+static size_t
+differential_test(lexicon* lex, const char* filename, size_t* n_sentences)
+{
+    wordlist* wl = wordlist_load(filename,DIFF_WORDS);
+    if(wl == NULL) return 0;
+
+    minseg_index* index = minseg_index_create(lex);
+    minseg_workspace* ws = minseg_workspace_create();
+    minseg_spans* spans = minseg_spans_create();
+    size_t mismatches = 0;
+    *n_sentences = 0;
+    // o caractere fora do lexico ocupa uma posicao a mais
+    char32_t* sentence = malloc((DIFF_MAX_GROUP * wl->max_length + 2) * sizeof(char32_t));
+    if(sentence == NULL) abort();
+    char32_t oov[2];
+    u8to32("\u2603",oov);
+    if(lexicon_get_count(lex,oov)) abort();
+    size_t group = 1;
+    for(size_t i=0;i + group <= wl->n_lines;i += group)
+    {
+        size_t pos = 0;
+        for(size_t j=0;j<group;j++)
+        {
+            u32strcpy(sentence + pos,wl->lines[i+j]);
+            pos += wl->lengths[i+j];
+        }
+        if(pos == 0) continue;
+        if(*n_sentences % DIFF_OOV_EVERY == 0)
+        {
+            memmove(sentence + pos/2 + 1,sentence + pos/2,(pos - pos/2 + 1) * sizeof(char32_t));
+            sentence[pos/2] = oov[0];
+            pos++;
+        }
+
+        minseg* got = minseg_create(lex,sentence);
+        minseg* got_indexed = minseg_create_indexed(index,sentence);
+        minseg* expected = reference_minseg(lex,sentence);
+        if(!minseg_equal(got,expected) || !minseg_equal(got_indexed,expected)) 
+            mismatches++;
+        minseg_find_spans_with(ws,lex,u32view_make(sentence,pos),spans);
+        if(spans->size != got->size || spans->cost != got->cost) mismatches++;
+        (*n_sentences)++;
+
+        minseg_free(got);
+        minseg_free(got_indexed);
+        minseg_free(expected);
+        group = group % DIFF_MAX_GROUP + 1;
+    }
+
+    free(sentence);
+    wordlist_free(wl);
+    minseg_index_free(index);
+    minseg_workspace_free(ws);
+    minseg_spans_free(spans);
+    return mismatches;
+}
+
+// N melhores: frases de tres palavras da lista. A primeira segmentacao
+// deve ser a de minseg_find_spans, os custos nao podem diminuir, cada
+// custo deve ser a soma dos custos das palavras (e dos caracteres onde
+// nenhuma palavra termina) e nenhuma segmentacao pode se repetir.
+#define NBEST_K 8
+#define NBEST_SENTENCES 2000
+
+static bool
+spans_equal(const minseg_spans* a, const minseg_spans* b)
+{
+    if(a->size != b->size || a->cost != b->cost) return false;
+    for(size_t i=0;i<a->size;i++)
+        if(a->spans[i].offset != b->spans[i].offset || a->spans[i].length != b->spans[i].length) return false;
+    return true;
+}
+
+static size_t
+nbest_test(lexicon* lex, const char* filename)
+{
+    wordlist* wl = wordlist_load(filename,3 * NBEST_SENTENCES);
+    if(wl == NULL) return 0;
+
+    minseg_lattice* lattice = minseg_lattice_create();
+    minseg_spans* best = minseg_spans_create();
+    minseg_spans* results[NBEST_K];
+    for(size_t q=0;q<NBEST_K;q++) results[q] = minseg_spans_create();
+
+    size_t mismatches = 0, n_sentences = 0, n_paths = 0, n_arcs = 0;
+    char32_t* sentence = malloc((3 * wl->max_length + 1) * sizeof(char32_t));
+    if(sentence == NULL) abort();
+    clock_t start = clock();
+    for(size_t i=0;i + 3 <= wl->n_lines;i += 3)
+    {
+        size_t pos = 0;
+        for(size_t j=0;j<3;j++)
+        {
+            u32strcpy(sentence + pos,wl->lines[i+j]);
+            pos += wl->lengths[i+j];
+        }
+        if(pos == 0) continue;
+        u32view view = u32view_make(sentence,pos);
+
+        minseg_find_lattice(lex,view,lattice);
+        size_t n = minseg_lattice_nbest(lattice,NBEST_K,results);
+        minseg_find_spans(lex,view,best);
+        if(n == 0 || !spans_equal(results[0],best)) mismatches++;
+        for(size_t q=0;q<n;q++)
+        {
+            if(q > 0 && results[q]->cost < results[q-1]->cost) mismatches++;
+            double cost = 0;
+            for(size_t i=0;i<results[q]->size;i++)
+            {
+                double word_cost = lexicon_get_cost_view(lex,u32view_make(view.str + results[q]->spans[i].offset,
+                            results[q]->spans[i].length));
+                // arco de um caractere onde nenhuma palavra termina
+                if(word_cost == DBL_MAX && results[q]->spans[i].length == 1) 
+                    word_cost = log2((double) lex->total_counts + 1);
+                cost += word_cost;
+            }
+            if(cost != results[q]->cost) mismatches++;
+            for(size_t p=0;p<q;p++) if(spans_equal(results[p],results[q])) mismatches++;
+        }
+        n_paths += n;
+        n_arcs += lattice->n_arcs;
+        n_sentences++;
+    }
+    printf("N melhores: %zu frases, %zu arcos, %zu segmentacoes, %zu divergencias (%fs)\n", 
+            n_sentences, n_arcs, n_paths, mismatches, (float) (clock() - start) / CLOCKS_PER_SEC);
+
+    for(size_t q=0;q<NBEST_K;q++) minseg_spans_free(results[q]);
+    minseg_spans_free(best);
+    minseg_lattice_free(lattice);
+    free(sentence);
+    wordlist_free(wl);
+    return mismatches;
+}
+
+// Exportacao da trelica: cada trelica escrita e lida de volta deve
+// ter os mesmos arcos e dar as mesmas N melhores; um arquivo cortado
+// deve ser recusado.
+static size_t
+lattice_io_test(lexicon* lex, const char* filename)
+{
+    wordlist* wl = wordlist_load(filename,3 * NBEST_SENTENCES);
+    if(wl == NULL) return 0;
+    FILE* tmp = tmpfile();
+    if(tmp == NULL) abort();
+
+    minseg_lattice* lattice = minseg_lattice_create();
+    minseg_lattice* copy = minseg_lattice_create();
+    minseg_spans* results[NBEST_K];
+    minseg_spans* copy_results[NBEST_K];
+    for(size_t q=0;q<NBEST_K;q++) 
+    {
+        results[q] = minseg_spans_create();
+        copy_results[q] = minseg_spans_create();
+    }
+
+    size_t mismatches = 0, n_sentences = 0;
+    char32_t* sentence = malloc((3 * wl->max_length + 1) * sizeof(char32_t));
+    if(sentence == NULL) abort();
+    for(size_t i=0;i + 3 <= wl->n_lines;i += 3)
+    {
+        size_t pos = 0;
+        for(size_t j=0;j<3;j++)
+        {
+            u32strcpy(sentence + pos,wl->lines[i+j]);
+            pos += wl->lengths[i+j];
+        }
+        minseg_find_lattice(lex,u32view_make(sentence,pos),lattice);
+
+        rewind(tmp);
+        if(!minseg_lattice_write(lattice,tmp)) abort();
+        long size = ftell(tmp);
+        rewind(tmp);
+        if(!minseg_lattice_read(copy,tmp)) { mismatches++; continue; }
+
+        if(copy->length != lattice->length || copy->n_arcs != lattice->n_arcs) { mismatches++; continue; }
+        for(size_t a=0;a<lattice->n_arcs;a++)
+            if(copy->arcs[a].start != lattice->arcs[a].start || copy->arcs[a].end != lattice->arcs[a].end 
+                    || copy->arcs[a].cost != lattice->arcs[a].cost) mismatches++;
+        for(size_t p=0;p<=lattice->length;p++)
+            if(copy->end_offsets[p] != lattice->end_offsets[p]) mismatches++;
+        size_t n = minseg_lattice_nbest(lattice,NBEST_K,results);
+        if(minseg_lattice_nbest(copy,NBEST_K,copy_results) != n) mismatches++;
+        else for(size_t q=0;q<n;q++) if(!spans_equal(results[q],copy_results[q])) mismatches++;
+
+        // sem o ultimo byte o arquivo deve ser recusado
+        if(size > 0 && lattice->n_arcs > 0)
+        {
+            rewind(tmp);
+            char* bytes = malloc(size);
+            if(bytes == NULL || fread(bytes,1,size,tmp) != (size_t) size) abort();
+            FILE* cut = tmpfile();
+            if(cut == NULL) abort();
+            fwrite(bytes,1,size - 1,cut);
+            rewind(cut);
+            if(minseg_lattice_read(copy,cut) || copy->n_arcs != 0) mismatches++;
+            fclose(cut);
+            free(bytes);
+        }
+        n_sentences++;
+    }
+    printf("Exportacao da trelica: %zu frases, %zu divergencias\n", n_sentences, mismatches);
+
+    for(size_t q=0;q<NBEST_K;q++) 
+    {
+        minseg_spans_free(results[q]);
+        minseg_spans_free(copy_results[q]);
+    }
+    minseg_lattice_free(copy);
+    minseg_lattice_free(lattice);
+    free(sentence);
+    fclose(tmp);
+    wordlist_free(wl);
+    return mismatches;
+}
+
+// Fluxo: as primeiras palavras da lista, uma por linha, lidas de um
+// descritor em pedacos. Sem as quebras de linha o texto e uma frase
+// longa, e os segmentos emitidos devem ser os de minseg_find_spans
+// sobre o texto inteiro.
+#define STREAM_WORDS 20000
+
+typedef struct stream_check
+{
+    const minseg_spans* expected;
+    size_t next;
+    size_t mismatches;
+} stream_check;
+
+static void
+check_segment(void* context, u32view word, uint64_t offset)
+{
+    stream_check* check = context;
+    if(check->next >= check->expected->size) 
+    {
+        check->mismatches++;
+        return;
+    }
+    const minseg_span* span = &check->expected->spans[check->next++];
+    if(span->offset != offset || span->length != word.len) check->mismatches++;
+}
+
+static size_t
+stream_test(lexicon* lex, const char* filename)
+{
+    wordlist* wl = wordlist_load(filename,STREAM_WORDS);
+    if(wl == NULL) return 0;
+    FILE* tmp = tmpfile();
+    if(tmp == NULL) abort();
+
+    size_t length = 0;
+    for(size_t i=0;i<wl->n_lines;i++) length += wl->lengths[i];
+    char32_t* text = malloc((length + 1) * sizeof(char32_t));
+    char* buffer = malloc(4 * wl->max_length + 1);
+    if(text == NULL || buffer == NULL) abort();
+    length = 0;
+    for(size_t i=0;i<wl->n_lines;i++)
+    {
+        u32to8(wl->lines[i],buffer);
+        fprintf(tmp,"%s\n",buffer);
+        u32strcpy(text + length,wl->lines[i]);
+        length += wl->lengths[i];
+    }
+    free(buffer);
+    wordlist_free(wl);
+    fflush(tmp);
+    rewind(tmp);
+
+    minseg_spans* expected = minseg_spans_create();
+    minseg_find_spans(lex,u32view_make(text,length),expected);
+
+    stream_check check = { expected, 0, 0 };
+    minseg_stream* stream = minseg_stream_create(lex,check_segment,&check);
+    clock_t start = clock();
+    if(!minseg_stream_read_fd(stream,fileno(tmp))) check.mismatches++;
+    if(check.next != expected->size) check.mismatches++;
+    printf("Fluxo: %zu caracteres, %zu segmentos, janela de %zu, %llu cortes forcados, %zu divergencias (%fs)\n",
+            length, check.next, stream->window, stream->forced_commits, check.mismatches, 
+            (float) (clock() - start) / CLOCKS_PER_SEC);
+
+    minseg_stream_free(stream);
+    minseg_spans_free(expected);
+    free(text);
+    fclose(tmp);
+    return check.mismatches;
+}
+
+// Cortes forcados: com so "a" e "aa" no lexico, os melhores caminhos
+// para posicoes pares e impares nunca se encontram, entao a janela
+// enche e o fluxo precisa cortar. Os segmentos emitidos devem ser
+// contiguos e cobrir o texto inteiro.
+#define FORCED_LENGTH 100000
+#define FORCED_CHUNK 1000
+
+typedef struct coverage_check
+{
+    uint64_t end;
+    size_t mismatches;
+} coverage_check;
+
+static void
+check_coverage(void* context, u32view word, uint64_t offset)
+{
+    coverage_check* check = context;
+    if(offset != check->end || word.len == 0 || word.len > 2) check->mismatches++;
+    for(size_t i=0;i<word.len;i++) if(word.str[i] != 'a') check->mismatches++;
+    check->end = offset + word.len;
+}
+
+static size_t
+forced_commit_test()
+{
+    lexicon* lex = lexicon_create();
+    char32_t word[3];
+    u8to32("a",word);
+    lexicon_add(lex,word,1);
+    u8to32("aa",word);
+    lexicon_add(lex,word,1);
+    lexicon_score(lex);
+
+    char32_t chunk[FORCED_CHUNK];
+    for(size_t i=0;i<FORCED_CHUNK;i++) chunk[i] = 'a';
+    coverage_check check = { 0, 0 };
+    minseg_stream* stream = minseg_stream_create(lex,check_coverage,&check);
+    for(size_t pushed=0;pushed<FORCED_LENGTH;pushed+=FORCED_CHUNK)
+        minseg_stream_push(stream,u32view_make(chunk,FORCED_CHUNK));
+    minseg_stream_finish(stream);
+    if(check.end != FORCED_LENGTH || stream->forced_commits == 0) check.mismatches++;
+    printf("Cortes forcados: %zu caracteres, %llu cortes, %zu divergencias\n", 
+            (size_t) check.end, stream->forced_commits, check.mismatches);
+
+    minseg_stream_free(stream);
+    lexicon_free(lex);
+    return check.mismatches;
+}
+
+// Caractere fora do lexico: todos os caminhos devem isola-lo e
+// continuar achando as palavras depois dele, com o mesmo custo finito
+static size_t
+unknown_test(lexicon* lex)
+{
+    char32_t sentence[16];
+    u8to32("casa\u2603decampo",sentence);
+    u32view view = u32view_from(sentence);
+    const size_t offsets[] = { 0, 4, 5, 7 };
+    const size_t lengths[] = { 4, 1, 2, 5 };
+
+    minseg_spans* expected = minseg_spans_create();
+    minseg_find_spans(lex,view,expected);
+    size_t mismatches = expected->size != 4 || expected->cost == DBL_MAX;
+    for(size_t i=0;i<expected->size && i<4;i++)
+        if(expected->spans[i].offset != offsets[i] || expected->spans[i].length != lengths[i]) mismatches++;
+
+    minseg_index* index = minseg_index_create(lex);
+    minseg_spans* got = minseg_spans_create();
+    minseg_find_spans_indexed(index,view,got);
+    if(!spans_equal(got,expected)) mismatches++;
+    minseg_find_spans_batch(lex,&view,1,&got);
+    if(!spans_equal(got,expected)) mismatches++;
+    if(minseg_find_nbest(lex,view,1,&got) != 1 || !spans_equal(got,expected)) mismatches++;
+
+    stream_check check = { expected, 0, 0 };
+    minseg_stream* stream = minseg_stream_create(lex,check_segment,&check);
+    minseg_stream_push(stream,view);
+    minseg_stream_finish(stream);
+    if(check.next != expected->size) check.mismatches++;
+    mismatches += check.mismatches;
+
+    printf("Caractere fora do lexico: %zu segmentos, custo %f, %zu divergencias\n", 
+            expected->size, expected->cost, mismatches);
+    minseg_stream_free(stream);
+    minseg_spans_free(got);
+    minseg_spans_free(expected);
+    minseg_index_free(index);
+    return mismatches;
+}
+
+// Lote: frases de group linhas consecutivas da lista. Compara
+// minseg_create frase a frase com minseg_create_batch, e
+// minseg_find_spans_with com minseg_find_spans_batch, em frases por
+// segundo. Os resultados devem ser iguais. A tabela da lista cabe no
+// cache, entao a busca antecipada do lote pouco ganha aqui; ela serve
+// para lexicos maiores que o cache.
+static size_t
+batch_test(lexicon* lex, const char* filename, size_t group)
+{
+    wordlist* wl = wordlist_load(filename,0);
+    if(wl == NULL) return 0;
+
+    size_t n_sentences = wl->n_lines / group;
+    char32_t** sentences = malloc((n_sentences + 1) * sizeof(char32_t*));
+    if(sentences == NULL) abort();
+    for(size_t s=0;s<n_sentences;s++)
+    {
+        size_t len = 0;
+        for(size_t j=0;j<group;j++) len += wl->lengths[s * group + j];
+        sentences[s] = malloc((len + 1) * sizeof(char32_t));
+        if(sentences[s] == NULL) abort();
+        len = 0;
+        for(size_t j=0;j<group;j++)
+        {
+            u32strcpy(sentences[s] + len,wl->lines[s * group + j]);
+            len += wl->lengths[s * group + j];
+        }
+    }
+    wordlist_free(wl);
+
+    minseg** single = malloc(n_sentences * sizeof(minseg*));
+    minseg** batch = malloc(n_sentences * sizeof(minseg*));
+    u32view* views = malloc(n_sentences * sizeof(u32view));
+    minseg_spans** spans = malloc(n_sentences * sizeof(minseg_spans*));
+    if(single == NULL || batch == NULL || views == NULL || spans == NULL) abort();
+    for(size_t i=0;i<n_sentences;i++) 
+    {
+        views[i] = u32view_from(sentences[i]);
+        spans[i] = minseg_spans_create();
+    }
+
+    clock_t start = clock();
+    for(size_t i=0;i<n_sentences;i++) single[i] = minseg_create(lex,sentences[i]);
+    float single_sec = (float) (clock() - start) / CLOCKS_PER_SEC;
+    start = clock();
+    minseg_create_batch(lex,(const char32_t* const*) sentences,n_sentences,batch);
+    float batch_sec = (float) (clock() - start) / CLOCKS_PER_SEC;
+
+    size_t mismatches = 0;
+    for(size_t i=0;i<n_sentences;i++) if(!minseg_equal(single[i],batch[i])) mismatches++;
+    printf("Lote de %zu linha(s) por frase: %zu frases, minseg_create %.0f frases/s, minseg_create_batch %.0f frases/s\n",
+            group, n_sentences, n_sentences / single_sec, n_sentences / batch_sec);
+
+    minseg_workspace* ws = minseg_workspace_create();
+    minseg_spans* one = minseg_spans_create();
+    start = clock();
+    for(size_t i=0;i<n_sentences;i++) minseg_find_spans_with(ws,lex,views[i],one);
+    single_sec = (float) (clock() - start) / CLOCKS_PER_SEC;
+    start = clock();
+    minseg_find_spans_batch(lex,views,n_sentences,spans);
+    batch_sec = (float) (clock() - start) / CLOCKS_PER_SEC;
+    for(size_t i=0;i<n_sentences;i++) 
+        if(spans[i]->size != single[i]->size || spans[i]->cost != single[i]->cost) mismatches++;
+    printf("Lote de %zu linha(s) por frase: minseg_find_spans_with %.0f frases/s, minseg_find_spans_batch %.0f frases/s, %zu divergencias\n",
+            group, n_sentences / single_sec, n_sentences / batch_sec, mismatches);
+
+    for(size_t i=0;i<n_sentences;i++)
+    {
+        minseg_free(single[i]);
+        minseg_free(batch[i]);
+        minseg_spans_free(spans[i]);
+        free(sentences[i]);
+    }
+    minseg_spans_free(one);
+    minseg_workspace_free(ws);
+    free(single); free(batch); free(views); free(spans); free(sentences);
+    return mismatches;
+}
+
+// Cache de segmentacoes: as palavras da lista se repetem muito, entao
+// a maioria das consultas deve acertar. Cada resultado e comparado com
+// minseg_create, e uma insercao no lexico deve invalidar o cache.
+#define CACHE_WORDS 30000
+#define CACHE_CAPACITY 1024
+
+static size_t
+cache_test(const char* filename)
+{
+    wordlist* wl = wordlist_load(filename,CACHE_WORDS);
+    if(wl == NULL || wl->n_lines == 0) return 0;
+
+    // lexico proprio, pois o teste o altera no final
+    lexicon* lex = lexicon_create();
+    lexicon_populate_from_wordlist_file(lex,filename);
+
+    minseg_cache* cache = minseg_cache_create(lex,CACHE_CAPACITY);
+    size_t mismatches = 0;
+    clock_t start = clock();
+    for(size_t i=0;i<wl->n_lines;i++)
+    {
+        minseg* got = minseg_create_cached(cache,wl->lines[i]);
+        minseg* expected = minseg_create(lex,wl->lines[i]);
+        if(!minseg_equal(got,expected)) mismatches++;
+        minseg_free(got);
+        minseg_free(expected);
+    }
+    printf("Cache: %llu acertos, %llu falhas, %llu remocoes (%fs)\n", 
+            cache->hits, cache->misses, cache->evictions, (float) (clock() - start) / CLOCKS_PER_SEC);
+
+    // Depois de lexicon_add a mesma frase deve ser segmentada de novo
+    const char32_t* word = wl->lines[wl->n_lines - 1];
+    uint64_t misses = cache->misses;
+    minseg_free(minseg_create_cached(cache,word));
+    lexicon_add(lex,word,1);
+    minseg* got = minseg_create_cached(cache,word);
+    minseg* expected = minseg_create(lex,word);
+    if(!minseg_equal(got,expected) || cache->misses != misses + 1) mismatches++;
+    minseg_free(got);
+    minseg_free(expected);
+
+    minseg_cache_free(cache);
+    lexicon_free(lex);
+    wordlist_free(wl);
+    return mismatches;
+}
+
 int main()
 {
     lexicon* lex = lexicon_create();
@@ -13,6 +673,27 @@ int main()
 
     lexicon_populate_from_wordlist_file(lex, "./test_res/wordlist.txt");
 
+    size_t n_sentences = 0;
+    clock_t diff_start = clock();
+    size_t mismatches = differential_test(lex,"./test_res/wordlist.txt",&n_sentences);
+    printf("Teste diferencial: %zu frases, %zu divergencias (%fs)\n", 
+            n_sentences, mismatches, (float) (clock() - diff_start) / CLOCKS_PER_SEC);
+    if(mismatches) return -1;
+
+    if(nbest_test(lex,"./test_res/wordlist.txt")) return -1;
+    if(lattice_io_test(lex,"./test_res/wordlist.txt")) return -1;
+    if(stream_test(lex,"./test_res/wordlist.txt")) return -1;
+    if(forced_commit_test()) return -1;
+    if(unknown_test(lex)) return -1;
+    if(batch_test(lex,"./test_res/wordlist.txt",1)) return -1;
+    if(batch_test(lex,"./test_res/wordlist.txt",3)) return -1;
+
+    if(cache_test("./test_res/wordlist.txt")) 
+    {
+        printf("Cache divergiu de minseg_create\n");
+        return -1;
+    }
+
     char sentence[144];
     
     printf("Digite uma frase ate 144 caracteres sem espacos: ");
@@ -39,6 +720,25 @@ int main()
     }
     printf("\nCusto = %lf", res->cost);
 
+    minseg_spans* results[NBEST_K];
+    for(size_t q=0;q<NBEST_K;q++) results[q] = minseg_spans_create();
+    size_t n = minseg_find_nbest(lex,u32view_from(sentence32),NBEST_K,results);
+    printf("\n%zu melhores:", n);
+    for(size_t q=0;q<n;q++)
+    {
+        printf("\n%lf ", results[q]->cost);
+        for(size_t i=0;i<results[q]->size;i++)
+        {
+            char buff[100];
+            char32_t word[100];
+            u32view_copy(word,u32view_make(sentence32 + results[q]->spans[i].offset,results[q]->spans[i].length));
+            u32to8(word,buff);
+            printf("%s ", buff);
+        }
+        minseg_spans_free(results[q]);
+    }
+    for(size_t q=n;q<NBEST_K;q++) minseg_spans_free(results[q]);
+
     free(sentence32); sentence32 = NULL;
     minseg_free(res);
     return 0;